@@ -0,0 +1,429 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <filesystem>
+#include "kvstore.h"
+
+
+const int BENCH_RECORDS = 1000000;
+
+using BenchClock = std::chrono::steady_clock;
+
+double nsPerOp(BenchClock::time_point start, int ops) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - start).count();
+    return static_cast<double>(ns) / ops;
+}
+
+// --- Encode / Decode ---
+
+// The original per-byte helpers, kept here as the baseline.
+void legacyEncodeLength(Buffer& buffer, uint32_t length) {
+    buffer.push_back(static_cast<uint8_t>((length >> 24) & 0xFF));
+    buffer.push_back(static_cast<uint8_t>((length >> 16) & 0xFF));
+    buffer.push_back(static_cast<uint8_t>((length >> 8) & 0xFF));
+    buffer.push_back(static_cast<uint8_t>(length & 0xFF));
+}
+
+void legacyEncodeBytes(Buffer& buffer, const std::string& str) {
+    for (char c : str) {
+        buffer.push_back(static_cast<uint8_t>(c));
+    }
+}
+
+std::string legacyDecodeBytes(const Buffer& buffer, size_t& offset, uint32_t length) {
+    if (offset + length > buffer.size()) throw std::runtime_error("underflow");
+    std::string str;
+    for (size_t i = 0; i < length; ++i) {
+        str += static_cast<char>(buffer[offset + i]);
+    }
+    offset += length;
+    return str;
+}
+
+void runEncodeBench() {
+    std::cout << "--- [BENCH] encode/decode, " << BENCH_RECORDS << " records ---\n";
+    const int blockRecords = 1000;
+    std::vector<std::string> keys;
+    for (int i = 0; i < blockRecords; i++) {
+        std::string digits = std::to_string(i);
+        keys.push_back("user:" + std::string(12 - digits.size(), '0') + digits);
+    }
+    std::vector<std::string> internalKeys;
+    for (int i = 0; i < blockRecords; i++) internalKeys.push_back(internalKey(keys[i], i + 1, ValueType::Value));
+    std::string value(100, 'v');
+    size_t sink = 0;
+
+    // Mirrors the old put(): a fresh Buffer and per-byte appends for every record.
+    auto start = BenchClock::now();
+    for (int i = 0; i < BENCH_RECORDS; i++) {
+        const std::string& key = keys[i % blockRecords];
+        Buffer logEntry;
+        legacyEncodeLength(logEntry, key.size());
+        legacyEncodeBytes(logEntry, key);
+        legacyEncodeLength(logEntry, value.size());
+        legacyEncodeBytes(logEntry, value);
+        sink += logEntry.size();
+    }
+    double legacyEncode = nsPerOp(start, BENCH_RECORDS);
+
+    // What put() does now: a one-entry WriteBatch framed as a WAL record.
+    start = BenchClock::now();
+    WriteBatch batch;
+    Buffer logRecord;
+    for (int i = 0; i < BENCH_RECORDS; i++) {
+        batch.clear();
+        batch.put(keys[i % blockRecords], value);
+        logRecord.clear();
+        encodeWalRecord(logRecord, i + 1, batch.contents());
+        sink += logRecord.size();
+    }
+    double walEncode = nsPerOp(start, BENCH_RECORDS);
+
+    // What a flush does: internal keys added to a data block, cut every blockRecords.
+    start = BenchClock::now();
+    BlockBuilder builder;
+    for (int i = 0; i < BENCH_RECORDS; i++) {
+        builder.add(internalKeys[i % blockRecords], value);
+        if (i % blockRecords == blockRecords - 1) sink += builder.finish().size();
+    }
+    double blockEncode = nsPerOp(start, BENCH_RECORDS);
+
+    Buffer legacyBlock;
+    for (const auto& key : keys) {
+        legacyEncodeLength(legacyBlock, key.size());
+        legacyEncodeBytes(legacyBlock, key);
+        legacyEncodeLength(legacyBlock, value.size());
+        legacyEncodeBytes(legacyBlock, value);
+    }
+    for (const auto& key : internalKeys) builder.add(key, value);
+    Buffer block = builder.finish();
+    int decodeOps = BENCH_RECORDS / blockRecords;
+
+    start = BenchClock::now();
+    for (int r = 0; r < decodeOps; r++) {
+        size_t offset = 0;
+        while (offset < legacyBlock.size()) {
+            uint32_t kLen = decodeLength(legacyBlock, offset);
+            std::string k = legacyDecodeBytes(legacyBlock, offset, kLen);
+            uint32_t vLen = decodeLength(legacyBlock, offset);
+            std::string v = legacyDecodeBytes(legacyBlock, offset, vLen);
+            sink += k.size() + v.size();
+        }
+    }
+    double legacyDecode = nsPerOp(start, decodeOps * blockRecords);
+
+    // A scan over the block: keys rebuilt from their shared prefixes, values in place.
+    start = BenchClock::now();
+    for (int r = 0; r < decodeOps; r++) {
+        BlockIterator it(asView(block), SSTABLE_FORMAT_CURRENT);
+        for (it.seekToFirst(); it.valid(); it.next()) sink += it.key().size() + it.value().size();
+    }
+    double blockDecode = nsPerOp(start, decodeOps * blockRecords);
+
+    std::cout << "encode  legacy: " << legacyEncode << " ns/record | WAL record: " << walEncode
+              << " ns/record | data block: " << blockEncode << " ns/record\n";
+    std::cout << "decode  legacy: " << legacyDecode << " ns/record | data block: " << blockDecode << " ns/record\n";
+    std::cout << "(checksum " << sink << ")\n";
+}
+
+// --- WAL Group Commit ---
+
+// Runs fn inside a fresh scratch directory, since KVStore keeps its files in the cwd.
+template <typename Fn>
+void inScratchDir(const std::string& name, Fn&& fn) {
+    auto home = std::filesystem::current_path();
+    std::filesystem::remove_all(name);
+    std::filesystem::create_directory(name);
+    std::filesystem::current_path(name);
+    fn();
+    std::filesystem::current_path(home);
+    std::filesystem::remove_all(name);
+}
+
+void runWalBench() {
+    const int totalOps = 20000;
+    std::cout << "--- [BENCH] WAL group commit, " << totalOps << " puts per run ---\n";
+
+    struct Mode { const char* name; WalSyncMode mode; };
+    Mode modes[] = {
+        {"no-sync", WalSyncMode::NoSync},
+        {"sync-interval(10ms)", WalSyncMode::SyncInterval},
+        {"sync-per-batch", WalSyncMode::SyncPerBatch},
+    };
+
+    for (const Mode& m : modes) {
+        for (int threads : {1, 2, 4, 8, 16}) {
+            inScratchDir("bench_wal_db", [&]() {
+                Options opts;
+                opts.walSyncMode = m.mode;
+                opts.walSyncIntervalMs = 10;
+                KVStore db(opts);
+                std::string value(100, 'v');
+
+                auto start = BenchClock::now();
+                std::vector<std::thread> workers;
+                for (int t = 0; t < threads; t++) {
+                    workers.emplace_back([&, t]() {
+                        for (int i = t; i < totalOps; i += threads) {
+                            db.put("key:" + std::to_string(i), value);
+                        }
+                    });
+                }
+                for (auto& worker : workers) worker.join();
+                double secs = nsPerOp(start, 1) / 1e9;
+
+                std::cout << m.name << "\tthreads=" << threads << "\t"
+                          << static_cast<long>(totalOps / secs) << " puts/s\n";
+            });
+        }
+    }
+}
+
+// --- Concurrent MemTable ---
+
+void runMemtableBench() {
+    const int totalOps = 1000000;
+    std::cout << "--- [BENCH] concurrent memtable, " << totalOps << " keys per run ---\n";
+    std::string value(100, 'v');
+
+    for (int threads : {1, 2, 4, 8, 16}) {
+        MemTable table;
+        auto keyFor = [](int i) {
+            return internalKey("key:" + std::to_string((i * 2654435761u) % 100000000u), i + 1, ValueType::Value);
+        };
+
+        auto start = BenchClock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                for (int i = t; i < totalOps; i += threads) table.insert(keyFor(i), value);
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        double insertSecs = nsPerOp(start, 1) / 1e9;
+
+        std::atomic<size_t> found{0};
+        start = BenchClock::now();
+        workers.clear();
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                size_t hits = 0;
+                for (int i = t; i < totalOps; i += threads) {
+                    std::string key = keyFor(i);
+                    const Node* node = table.seek(key);
+                    hits += node != nullptr && node->key() == key;
+                }
+                found += hits;
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        double findSecs = nsPerOp(start, 1) / 1e9;
+
+        std::cout << "threads=" << threads << "\tinsert " << static_cast<long>(totalOps / insertSecs)
+                  << " ops/s\tfind " << static_cast<long>(totalOps / findSecs) << " ops/s"
+                  << "\t(found " << found << ")\n";
+    }
+}
+
+// --- Bloom Filter ---
+
+// The original filter: std::vector<bool> bits, probes spread over the whole array and a
+// salted std::hash that allocates on every call. Kept here as the baseline.
+struct LegacyBloomFilter {
+    std::vector<bool> bitArray;
+    int numHashes;
+    int sizeInBits;
+
+    LegacyBloomFilter(int n, double p = 0.01) {
+        double m = -(n * log(p)) / (pow(log(2), 2));
+        sizeInBits = static_cast<int>(ceil(m));
+        numHashes = static_cast<int>(ceil((m / n) * log(2)));
+        bitArray.resize(sizeInBits, false);
+    }
+
+    static std::pair<size_t, size_t> hashKey(const std::string& key) {
+        return {std::hash<std::string>()(key), std::hash<std::string>()(key + "_salt")};
+    }
+
+    void add(const std::string& key) {
+        auto [h1, h2] = hashKey(key);
+        for (int i = 0; i < numHashes; i++) bitArray[(h1 + i * h2) % sizeInBits] = true;
+    }
+
+    bool possiblyContains(const std::string& key) const {
+        auto [h1, h2] = hashKey(key);
+        for (int i = 0; i < numHashes; i++) {
+            if (!bitArray[(h1 + i * h2) % sizeInBits]) return false;
+        }
+        return true;
+    }
+};
+
+// Negative lookups, the miss path of get(): filterCount filters (think L0 files) of
+// keysPerFilter keys each, probed with keys none of them hold.
+void runBloomBench() {
+    const int filterCount = 8;
+    const int keysPerFilter = 200000;
+    const int probes = 1000000;
+    std::cout << "--- [BENCH] Bloom filter negative lookups, " << filterCount << " filters x "
+              << keysPerFilter << " keys, " << probes << " probes ---\n";
+
+    // Every filter's keys span the same range and so do the misses, so in the store
+    // run below no table can be skipped on its key range alone.
+    auto keyFor = [](int filter, int i) { return "user:" + std::to_string(i) + ":" + std::to_string(filter); };
+    std::vector<std::string> missing;
+    missing.reserve(probes);
+    for (int i = 0; i < probes; i++) {
+        missing.push_back("user:" + std::to_string((i * 2654435761u) % keysPerFilter) + ":miss");
+    }
+
+    std::vector<LegacyBloomFilter> legacy;
+    for (int f = 0; f < filterCount; f++) {
+        legacy.emplace_back(keysPerFilter);
+        for (int i = 0; i < keysPerFilter; i++) legacy.back().add(keyFor(f, i));
+    }
+    size_t legacyHits = 0;
+    auto start = BenchClock::now();
+    for (const auto& key : missing) {
+        for (const auto& bf : legacy) legacyHits += bf.possiblyContains(key);
+    }
+    double legacyNs = nsPerOp(start, probes * filterCount);
+    std::cout << "legacy\t\t" << legacyNs << " ns/probe\tfalse positives "
+              << 100.0 * legacyHits / (static_cast<double>(probes) * filterCount) << "%\n";
+
+    for (int bitsPerKey : {6, 10, 14}) {
+        std::vector<BloomFilter> blocked;
+        for (int f = 0; f < filterCount; f++) {
+            blocked.emplace_back(keysPerFilter, bitsPerKey);
+            for (int i = 0; i < keysPerFilter; i++) blocked.back().add(keyFor(f, i));
+        }
+        // get() hashes the key once and probes every table with it.
+        size_t hits = 0;
+        start = BenchClock::now();
+        for (const auto& key : missing) {
+            uint64_t hash = BloomFilter::hashKey(key);
+            for (const auto& bf : blocked) hits += bf.possiblyContainsHash(hash);
+        }
+        double ns = nsPerOp(start, probes * filterCount);
+        std::cout << "blocked(" << bitsPerKey << " bits/key)\t" << ns << " ns/probe\tfalse positives "
+                  << 100.0 * hits / (static_cast<double>(probes) * filterCount) << "%\n";
+    }
+
+    // End to end: get() of absent keys against a store whose data sits in L0 files.
+    inScratchDir("bench_bloom_db", [&]() {
+        Options opts;
+        opts.level0CompactionTrigger = 64;
+        opts.level0SlowdownTrigger = 64;
+        opts.level0StopTrigger = 64;
+        KVStore db(opts);
+        std::string value(100, 'v');
+        for (int f = 0; f < filterCount; f++) {
+            for (int i = 0; i < 20000; i++) db.put(keyFor(f, i), value);
+            db.flush();
+        }
+        const int gets = 200000;
+        size_t found = 0;
+        auto start = BenchClock::now();
+        for (int i = 0; i < gets; i++) found += !db.get(missing[i]).empty();
+        double secs = nsPerOp(start, 1) / 1e9;
+        std::cout << "store get() misses over " << filterCount << " L0 files: "
+                  << static_cast<long>(gets / secs) << " gets/s\t(found " << found << ")\n";
+    });
+}
+
+// --- Checksums ---
+
+// CRC32C throughput of the table-driven fallback and the hardware kernel at WAL-record,
+// block and large-buffer sizes, then what verifying every block costs get().
+void runCrcBench() {
+    std::cout << "--- [BENCH] CRC32C, hardware kernel "
+              << (crc32cHardwareAvailable() ? "available" : "not available") << " ---\n";
+
+    struct Kernel { const char* name; uint32_t (*fn)(const uint8_t*, size_t, uint32_t); };
+    std::vector<Kernel> kernels = {{"software", crc32cSoftware}};
+#ifdef KVSTORE_HAVE_HW_CRC32C
+    if (crc32cHardwareAvailable()) kernels.push_back({"hardware", crc32cHardware});
+#endif
+
+    const size_t totalBytes = 1ull << 30;
+    for (size_t size : {64, 4096, 1 << 20}) {
+        Buffer data(size);
+        for (size_t i = 0; i < size; i++) data[i] = static_cast<uint8_t>(i * 131);
+        for (const Kernel& k : kernels) {
+            size_t rounds = totalBytes / size;
+            uint32_t crc = 0;
+            auto start = BenchClock::now();
+            for (size_t r = 0; r < rounds; r++) crc = k.fn(data.data(), size, crc);
+            double secs = nsPerOp(start, 1) / 1e9;
+            std::cout << k.name << "\t" << size << " B\t" << totalBytes / secs / 1e9 << " GB/s\t(crc " << crc << ")\n";
+        }
+    }
+
+    // Uncompressed random gets: uncached, so every lookup reads and checks its index
+    // partition, filter and data block, then from a warm cache, whose blocks are not
+    // checked again.
+    inScratchDir("bench_crc_db", [&]() {
+        const int keys = 200000;
+        {
+            Options opts;
+            opts.compression = CompressionType::None;
+            KVStore db(opts);
+            std::string value(100, 'v');
+            for (int i = 0; i < keys; i++) db.put("key:" + std::to_string(i), value);
+            db.flush();
+        }
+        for (size_t cacheSize : {size_t(0), size_t(64) << 20}) {
+            for (ChecksumMode mode : {ChecksumMode::Never, ChecksumMode::Always}) {
+                Options opts;
+                opts.blockCacheSize = cacheSize;
+                opts.checksumMode = mode;
+                KVStore db(opts);
+                const int gets = 200000;
+                auto getAll = [&]() {
+                    size_t found = 0;
+                    for (int i = 0; i < gets; i++) found += !db.get("key:" + std::to_string((i * 2654435761u) % keys)).empty();
+                    return found;
+                };
+                if (cacheSize) getAll();
+                auto start = BenchClock::now();
+                size_t found = getAll();
+                double secs = nsPerOp(start, 1) / 1e9;
+                std::cout << "store get() " << (cacheSize ? "cached" : "uncached")
+                          << " checksumMode=" << (mode == ChecksumMode::Always ? "always" : "never") << ": "
+                          << static_cast<long>(gets / secs) << " gets/s\t(found " << found << ")\n";
+            }
+        }
+    });
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2) {
+        std::cerr << "Usage: ./bench [encode|wal|memtable|bloom|crc]\n";
+        return 1;
+    }
+
+    std::string mode = argv[1];
+
+    if (mode == "encode") {
+        runEncodeBench();
+    }
+    else if (mode == "wal") {
+        runWalBench();
+    }
+    else if (mode == "memtable") {
+        runMemtableBench();
+    }
+    else if (mode == "bloom") {
+        runBloomBench();
+    }
+    else if (mode == "crc") {
+        runCrcBench();
+    }
+    else {
+        std::cerr << "Unknown mode. Use 'encode', 'wal', 'memtable', 'bloom' or 'crc'.\n";
+    }
+
+    return 0;
+}
@@ -6,266 +6,3815 @@
 #include <ctime>
 #include <cstring>
 #include <cstdint>
+#include <cerrno>
 #include <filesystem>
 #include <algorithm>
 #include <cmath>
 #include <functional>
 #include <map> 
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string_view>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <array>
+#include <random>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using Buffer = std::vector<uint8_t>;
 
 // --- Serialization Helpers ---
+// Fixed 4-byte big-endian lengths. Writers grow the buffer once per call and copy
+// whole spans; readers build each string in a single allocation.
+
+inline void putFixed32(uint8_t* dst, uint32_t value) {
+    dst[0] = static_cast<uint8_t>((value >> 24) & 0xFF);
+    dst[1] = static_cast<uint8_t>((value >> 16) & 0xFF);
+    dst[2] = static_cast<uint8_t>((value >> 8) & 0xFF);
+    dst[3] = static_cast<uint8_t>(value & 0xFF);
+}
+
+inline uint32_t getFixed32(const uint8_t* src) {
+    return (static_cast<uint32_t>(src[0]) << 24) | (static_cast<uint32_t>(src[1]) << 16) |
+           (static_cast<uint32_t>(src[2]) << 8) | static_cast<uint32_t>(src[3]);
+}
+
+inline void putFixed64(uint8_t* dst, uint64_t value) {
+    putFixed32(dst, static_cast<uint32_t>(value >> 32));
+    putFixed32(dst + 4, static_cast<uint32_t>(value));
+}
+
+inline uint64_t getFixed64(const uint8_t* src) {
+    return (static_cast<uint64_t>(getFixed32(src)) << 32) | getFixed32(src + 4);
+}
 
 inline void encodeLength(Buffer& buffer, uint32_t length) {
-    buffer.push_back(static_cast<uint8_t>((length >> 24) & 0xFF));
-    buffer.push_back(static_cast<uint8_t>((length >> 16) & 0xFF));
-    buffer.push_back(static_cast<uint8_t>((length >> 8) & 0xFF));
-    buffer.push_back(static_cast<uint8_t>(length & 0xFF));
+    size_t pos = buffer.size();
+    buffer.resize(pos + 4);
+    putFixed32(buffer.data() + pos, length);
 }
 
-inline void encodeBytes(Buffer& buffer, const std::string& str) {
-    for (char c : str) {
-        buffer.push_back(static_cast<uint8_t>(c));
-    }
+inline void encodeBytes(Buffer& buffer, std::string_view str) {
+    buffer.insert(buffer.end(), str.begin(), str.end());
 }
 
 inline uint32_t decodeLength(const Buffer& buffer, size_t& offset) {
     if (offset + 4 > buffer.size()) throw std::runtime_error("underflow");
-    uint32_t length = 0;
-    length |= (static_cast<uint32_t>(buffer[offset + 0]) << 24);
-    length |= (static_cast<uint32_t>(buffer[offset + 1]) << 16);
-    length |= (static_cast<uint32_t>(buffer[offset + 2]) << 8);
-    length |= (static_cast<uint32_t>(buffer[offset + 3]));
+    uint32_t length = getFixed32(buffer.data() + offset);
     offset += 4;
     return length;
 }
 
 inline std::string decodeBytes(const Buffer& buffer, size_t& offset, uint32_t length) {
     if (offset + length > buffer.size()) throw std::runtime_error("underflow");
-    std::string str;
-    for (size_t i = 0; i < length; ++i) {
-        str += static_cast<char>(buffer[offset + i]);
-    }
+    std::string str(reinterpret_cast<const char*>(buffer.data()) + offset, length);
     offset += length;
     return str;
 }
 
-// --- Bloom Filter ---
+// In-place variants used by the read path: keys and values come back as views
+// into the block they were decoded from, no copy.
+
+inline std::string_view asView(const Buffer& buffer) {
+    return std::string_view(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+}
+
+inline uint32_t decodeLength(std::string_view data, size_t& offset) {
+    if (offset + 4 > data.size()) throw std::runtime_error("underflow");
+    uint32_t length = getFixed32(reinterpret_cast<const uint8_t*>(data.data()) + offset);
+    offset += 4;
+    return length;
+}
+
+inline std::string_view decodeView(std::string_view data, size_t& offset, uint32_t length) {
+    if (offset + length > data.size()) throw std::runtime_error("underflow");
+    std::string_view view = data.substr(offset, length);
+    offset += length;
+    return view;
+}
+
+// LEB128 varints: 7 bits per byte, high bit set on every byte but the last.
+
+inline void encodeVarint32(Buffer& buffer, uint32_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+inline void encodeVarint64(Buffer& buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+inline uint64_t decodeVarint64(std::string_view data, size_t& offset) {
+    uint64_t result = 0;
+    for (int shift = 0; shift <= 63; shift += 7) {
+        if (offset >= data.size()) throw std::runtime_error("underflow");
+        uint64_t byte = static_cast<uint8_t>(data[offset++]);
+        result |= (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return result;
+    }
+    throw std::runtime_error("bad varint");
+}
+
+inline uint32_t decodeVarint32(std::string_view data, size_t& offset) {
+    uint32_t result = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (offset >= data.size()) throw std::runtime_error("underflow");
+        uint32_t byte = static_cast<uint8_t>(data[offset++]);
+        result |= (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return result;
+    }
+    throw std::runtime_error("bad varint");
+}
+
+// --- Checksums ---
+
+// CRC-32C (Castagnoli), reflected. crc32c() uses the CPU's CRC32 instruction when it
+// has one (SSE4.2 on x86, checked at run time; the CRC extension on ARMv8, at build
+// time) and slicing-by-8 tables otherwise. All variants give the same result, and
+// crc32c(b, crc32c(a)) is the CRC of a followed by b.
+
+inline uint32_t crc32cSoftware(const uint8_t* data, size_t n, uint32_t crc = 0) {
+    // table[k][b]: the CRC of byte b followed by k zero bytes.
+    static const std::array<std::array<uint32_t, 256>, 8> table = []() {
+        std::array<std::array<uint32_t, 256>, 8> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1);
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) t[k][i] = t[0][t[k - 1][i] & 0xFF] ^ (t[k - 1][i] >> 8);
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (; n >= 8; data += 8, n -= 8) {
+        uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | static_cast<uint32_t>(data[3]) << 24);
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][data[4]] ^ table[2][data[5]] ^ table[1][data[6]] ^ table[0][data[7]];
+    }
+    for (; n > 0; data++, n--) crc = table[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KVSTORE_HAVE_HW_CRC32C 1
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(const uint8_t* data, size_t n, uint32_t crc = 0) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; n >= 8; data += 8, n -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    for (; n >= 4; data += 4, n -= 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; n > 0; data++, n--) crc = _mm_crc32_u8(crc, *data);
+    return ~crc;
+}
+
+inline bool crc32cHardwareAvailable() {
+    static const bool available = __builtin_cpu_supports("sse4.2");
+    return available;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define KVSTORE_HAVE_HW_CRC32C 1
+inline uint32_t crc32cHardware(const uint8_t* data, size_t n, uint32_t crc = 0) {
+    crc = ~crc;
+    for (; n >= 8; data += 8, n -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; n > 0; data++, n--) crc = __crc32cb(crc, *data);
+    return ~crc;
+}
+
+inline bool crc32cHardwareAvailable() { return true; }
+#else
+inline bool crc32cHardwareAvailable() { return false; }
+#endif
+
+inline uint32_t crc32c(const uint8_t* data, size_t n, uint32_t crc = 0) {
+#ifdef KVSTORE_HAVE_HW_CRC32C
+    if (crc32cHardwareAvailable()) return crc32cHardware(data, n, crc);
+#endif
+    return crc32cSoftware(data, n, crc);
+}
+
+inline uint32_t crc32c(std::string_view data) {
+    return crc32c(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+}
+
+// --- Pinned Results ---
+
+// A value that points straight into a cached block or mapped file and holds a
+// reference that keeps it alive. Memtable hits are copied into the slice itself.
+class PinnableSlice {
+private:
+    std::string_view view;
+    std::shared_ptr<const void> pin;
+    std::string self;
+
+public:
+    PinnableSlice() = default;
+    PinnableSlice(const PinnableSlice&) = delete;
+    PinnableSlice& operator=(const PinnableSlice&) = delete;
+
+    void pinShared(std::string_view data, std::shared_ptr<const void> owner) {
+        self.clear();
+        view = data;
+        pin = std::move(owner);
+    }
+
+    void pinSelf(std::string_view data) {
+        pin.reset();
+        self.assign(data.data(), data.size());
+        view = self;
+    }
+
+    void reset() {
+        pin.reset();
+        self.clear();
+        view = std::string_view();
+    }
+
+    bool isPinned() const { return pin != nullptr; }
+    std::string_view data() const { return view; }
+    size_t size() const { return view.size(); }
+    bool empty() const { return view.empty(); }
+    std::string toString() const { return std::string(view); }
+};
+
+// --- Bloom Filter ---
+
+// 64-bit hash in the wyhash style: 16 bytes per round folded through a 64x64->128-bit
+// multiply. Input words are read little-endian so filters hash the same on every host.
+inline uint64_t hashMix(uint64_t a, uint64_t b) {
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+inline uint64_t loadLittle64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+inline uint64_t loadLittle32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+inline uint64_t hash64(std::string_view data, uint64_t seed = 0) {
+    const uint64_t P0 = 0xa0761d6478bd642fULL, P1 = 0xe7037ed1a0b428dbULL, P2 = 0x8ebc6af09c88c6e3ULL;
+    const char* p = data.data();
+    size_t n = data.size();
+    uint64_t h = seed ^ hashMix(seed ^ P0, P1);
+    uint64_t a = 0, b = 0;
+    if (n <= 16) {
+        if (n >= 8) {
+            a = loadLittle64(p);
+            b = loadLittle64(p + n - 8);
+        } else if (n >= 4) {
+            a = loadLittle32(p);
+            b = loadLittle32(p + n - 4);
+        } else if (n > 0) {
+            a = (static_cast<uint64_t>(static_cast<uint8_t>(p[0])) << 16) |
+                (static_cast<uint64_t>(static_cast<uint8_t>(p[n / 2])) << 8) | static_cast<uint8_t>(p[n - 1]);
+        }
+    } else {
+        size_t i = n;
+        while (i > 16) {
+            h = hashMix(loadLittle64(p) ^ P1, loadLittle64(p + 8) ^ h);
+            p += 16;
+            i -= 16;
+        }
+        a = loadLittle64(p + i - 16);
+        b = loadLittle64(p + i - 8);
+    }
+    return hashMix(P1 ^ n, hashMix(a ^ P1, b ^ h) ^ P2);
+}
+
+// Cache-line-blocked filter (v2 tables). A key's hash picks one 64-byte block and every
+// probe bit for the key lands inside it, so a lookup costs one cache miss however many
+// probes it makes. The probes are gathered into eight word masks and compared with the
+// block word by word, a branch-free loop the compiler vectorizes.
+// Serialized as [numProbes][numBlocks] then the blocks as little-endian 64-bit words.
+struct alignas(64) FilterBlock {
+    uint64_t words[8];
+};
+
+class BloomFilter {
+private:
+    std::vector<FilterBlock> blocks;
+    int numProbes = 0;
+
+    static size_t blockFor(uint64_t hash, size_t numBlocks) {
+        return static_cast<size_t>(((hash >> 32) * numBlocks) >> 32);
+    }
+
+    // Probe i sets bit (a + i * b) >> 23 of the block, a and b taken from the hash.
+    static void probeMasks(uint64_t hash, int probes, uint64_t masks[8]) {
+        for (int w = 0; w < 8; w++) masks[w] = 0;
+        uint32_t a = static_cast<uint32_t>(hash);
+        uint32_t b = static_cast<uint32_t>((hash * 0x9E3779B97F4A7C15ULL) >> 32) | 1;
+        for (int i = 0; i < probes; i++) {
+            uint32_t bit = a >> 23;
+            masks[bit >> 6] |= 1ULL << (bit & 63);
+            a += b;
+        }
+    }
+
+public:
+    BloomFilter() = default;
+
+    // Room for numKeys keys at bitsPerKey bits each, rounded up to whole blocks. With
+    // bitsPerKey <= 0 the filter is empty and passes every key.
+    BloomFilter(size_t numKeys, int bitsPerKey) {
+        if (bitsPerKey <= 0) return;
+        numProbes = std::clamp(static_cast<int>(bitsPerKey * 0.69 + 0.5), 1, 16);
+        size_t numBlocks = std::max<size_t>(1, (numKeys * bitsPerKey + 511) / 512);
+        blocks.assign(numBlocks, FilterBlock{});
+    }
+
+    // Builders that do not know the key count up front keep the hashes and add them
+    // once the filter is sized; readers hash a key once and probe several tables.
+    static uint64_t hashKey(std::string_view key) { return hash64(key); }
+
+    void addHash(uint64_t hash) {
+        if (blocks.empty()) return;
+        FilterBlock& block = blocks[blockFor(hash, blocks.size())];
+        uint64_t masks[8];
+        probeMasks(hash, numProbes, masks);
+        for (int w = 0; w < 8; w++) block.words[w] |= masks[w];
+    }
+
+    void add(std::string_view key) { addHash(hashKey(key)); }
+
+    bool possiblyContainsHash(uint64_t hash) const {
+        if (blocks.empty()) return true;
+        const FilterBlock& block = blocks[blockFor(hash, blocks.size())];
+        uint64_t masks[8];
+        probeMasks(hash, numProbes, masks);
+        uint64_t missing = 0;
+        for (int w = 0; w < 8; w++) missing |= masks[w] & ~block.words[w];
+        return missing == 0;
+    }
+
+    bool possiblyContains(std::string_view key) const { return possiblyContainsHash(hashKey(key)); }
+
+    // Probes a serialized blocked filter where it lies, e.g. a filter partition in the
+    // block cache, without copying it. A malformed filter passes every key.
+    static bool probeSerialized(std::string_view filter, uint64_t hash) {
+        size_t offset = 0;
+        if (filter.size() < 8) return true;
+        uint32_t probes = decodeLength(filter, offset);
+        uint32_t numBlocks = decodeLength(filter, offset);
+        if (numBlocks == 0 || probes == 0 || probes > 16 ||
+            (filter.size() - offset) / sizeof(FilterBlock) < numBlocks) {
+            return true;
+        }
+        const char* block = filter.data() + offset + blockFor(hash, numBlocks) * sizeof(FilterBlock);
+        uint64_t masks[8];
+        probeMasks(hash, static_cast<int>(probes), masks);
+        uint64_t missing = 0;
+        for (int w = 0; w < 8; w++) missing |= masks[w] & ~loadLittle64(block + w * 8);
+        return missing == 0;
+    }
+
+    size_t memoryUsage() const { return blocks.size() * sizeof(FilterBlock); }
+
+    void serialize(Buffer& buffer) const {
+        encodeLength(buffer, static_cast<uint32_t>(numProbes));
+        encodeLength(buffer, static_cast<uint32_t>(blocks.size()));
+        size_t pos = buffer.size();
+        size_t bytes = blocks.size() * sizeof(FilterBlock);
+        buffer.resize(pos + bytes);
+        if (bytes > 0) memcpy(buffer.data() + pos, blocks.data(), bytes);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (size_t i = pos; i < buffer.size(); i += 8) std::reverse(buffer.begin() + i, buffer.begin() + i + 8);
+#endif
+    }
+
+    // Reads the filter at offset and moves offset past it. A truncated filter comes back
+    // empty, so lookups fall through to the table.
+    static BloomFilter deserialize(std::string_view data, size_t& offset) {
+        BloomFilter bf;
+        if (offset > data.size() || data.size() - offset < 8) {
+            offset = data.size();
+            return bf;
+        }
+
+        uint32_t probes = decodeLength(data, offset);
+        uint32_t numBlocks = decodeLength(data, offset);
+        if (numBlocks == 0) return bf; // written with bitsPerKey 0
+        if (probes == 0 || probes > 16 || data.size() - offset < static_cast<uint64_t>(numBlocks) * sizeof(FilterBlock)) {
+            offset = data.size();
+            return bf;
+        }
+        bf.numProbes = static_cast<int>(probes);
+        bf.blocks.resize(numBlocks);
+        if (numBlocks > 0) memcpy(bf.blocks.data(), data.data() + offset, numBlocks * sizeof(FilterBlock));
+        offset += numBlocks * sizeof(FilterBlock);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (auto& block : bf.blocks) {
+            for (auto& word : block.words) word = __builtin_bswap64(word);
+        }
+#endif
+        return bf;
+    }
+};
+
+// --- Internal Keys ---
+// Every record carries the sequence number of the write that made it, and memtables and
+// tables are keyed by an internal key:
+//   [user key, each 0x00 escaped as 0x00 0xFF][0x00 0x01][~(sequence << 8 | type) u64]
+// Plain byte order on this encoding is user key ascending, then newest version first,
+// so the skip list, block search, index and merge keep comparing with operator<.
+
+enum class ValueType : uint8_t {
+    Deletion = 0,
+    Value = 1,
+};
+
+const uint64_t MAX_SEQUENCE = (1ULL << 56) - 1;
+const size_t INTERNAL_KEY_TRAILER_SIZE = 8;
+
+inline void appendKeyTrailer(std::string& out, uint64_t sequence, ValueType type) {
+    uint8_t trailer[INTERNAL_KEY_TRAILER_SIZE];
+    putFixed64(trailer, ~((sequence << 8) | static_cast<uint8_t>(type)));
+    out.append(reinterpret_cast<const char*>(trailer), sizeof(trailer));
+}
+
+inline void appendInternalKey(std::string& out, std::string_view userKey, uint64_t sequence, ValueType type) {
+    if (memchr(userKey.data(), 0, userKey.size()) == nullptr) {
+        out.append(userKey.data(), userKey.size());
+    } else {
+        for (char c : userKey) {
+            out.push_back(c);
+            if (c == '\0') out.push_back('\xFF');
+        }
+    }
+    out.push_back('\0');
+    out.push_back('\x01');
+    appendKeyTrailer(out, sequence, type);
+}
+
+inline std::string internalKey(std::string_view userKey, uint64_t sequence, ValueType type) {
+    std::string key;
+    appendInternalKey(key, userKey, sequence, type);
+    return key;
+}
+
+// The escaped user key with its terminator. Two of these are equal exactly when the
+// user keys are, and compare in the same order.
+inline std::string_view encodedUserKey(std::string_view key) {
+    return key.substr(0, key.size() - std::min(key.size(), INTERNAL_KEY_TRAILER_SIZE));
+}
+
+// The first n bytes of an encodedUserKey() without its terminator: the user key's own
+// first n bytes when it holds no NUL bytes, or all of it when shorter. Every key that
+// starts with a user prefix whose escaped form is at least n bytes gets the same one.
+inline std::string_view encodedKeyPrefix(std::string_view encodedUser, size_t n) {
+    size_t body = encodedUser.size() - std::min<size_t>(encodedUser.size(), 2);
+    return encodedUser.substr(0, std::min(n, body));
+}
+
+// sequence << 8 | type, or 0 for a key too short to have a trailer.
+inline uint64_t keyTrailer(std::string_view key) {
+    if (key.size() < INTERNAL_KEY_TRAILER_SIZE) return 0;
+    return ~getFixed64(reinterpret_cast<const uint8_t*>(key.data()) + key.size() - INTERNAL_KEY_TRAILER_SIZE);
+}
+
+inline uint64_t keySequence(std::string_view key) { return keyTrailer(key) >> 8; }
+inline ValueType keyType(std::string_view key) { return static_cast<ValueType>(keyTrailer(key) & 0xFF); }
+
+// Undoes the escaping of an encodedUserKey().
+inline std::string decodeUserKey(std::string_view encoded) {
+    std::string user;
+    for (size_t i = 0; i + 2 <= encoded.size(); i++) {
+        if (encoded[i] == '\0') {
+            if (encoded[i + 1] != '\xFF') break;
+            i++;
+            user.push_back('\0');
+            continue;
+        }
+        user.push_back(encoded[i]);
+    }
+    return user;
+}
+
+// The first internal key of whatever user key key belongs to: all of that user key's
+// versions sort at or after it.
+inline std::string firstVersionKey(std::string_view key) {
+    std::string first(encodedUserKey(key));
+    appendKeyTrailer(first, MAX_SEQUENCE, ValueType::Value);
+    return first;
+}
+
+// --- Structures ---
+
+// One entry per data block: the block's first key and its [offset, offset + size) range.
+// v1 tables only store the offset; size is the gap to the next block (or to the index),
+// which also lets tables written with the old every-3rd-record index load as small blocks.
+struct IndexEntry {
+    std::string key;
+    uint64_t offset;
+    uint32_t size;
+};
+
+// v2 tables: one per index partition, with the first key it indexes and where the
+// partition and the Bloom filter over its blocks' keys are stored. Sizes exclude the
+// 1-byte compression type both are followed by, as for data blocks.
+struct IndexPartition {
+    std::string key;
+    uint64_t offset;
+    uint32_t size;
+    uint64_t filterOffset;
+    uint32_t filterSize;
+};
+
+struct SSTableMetadata {
+    std::string filename;
+    uint64_t fileId = 0;
+    uint32_t formatVersion = 1;
+    // v1 tables load their whole block index with the table, and no filter: they are
+    // only read to be rewritten as v2 on open. v2 tables only keep the top-level index
+    // in indexPartitions; the partitions and their filters are read through the block
+    // cache when a lookup or scan needs them.
+    std::vector<IndexEntry> sparseIndex;
+    std::vector<IndexPartition> indexPartitions;
+    // Filters of the partitions, held in memory for L0 tables (Options::pinL0Filters).
+    std::vector<BloomFilter> pinnedFilters;
+    // Filter over the first prefixLength bytes of every key (v2, 0 = none), for scans
+    // limited to a prefix.
+    BloomFilter prefixFilter;
+    uint32_t prefixLength = 0;
+
+    uint64_t fileNumber = 0;
+    std::string smallestKey;
+    std::string largestKey;
+    uint64_t fileSize = 0;
+
+    // Set while a background compaction owns the file. Guarded by the store's mutex.
+    bool beingCompacted = false;
+    // Set once a compaction has replaced the file. The file itself is removed when the
+    // last version or reader holding this metadata lets go of it.
+    bool obsolete = false;
+
+    // By user key: versions of one key in two files make them overlap even though
+    // their internal keys differ.
+    bool overlaps(std::string_view smallest, std::string_view largest) const {
+        return !(encodedUserKey(largestKey) < encodedUserKey(smallest) ||
+                 encodedUserKey(largest) < encodedUserKey(smallestKey));
+    }
+
+    // Whether any key in [lower, upper) may be here, both encoded user keys and empty
+    // for no bound.
+    bool mayContainRange(std::string_view lower, std::string_view upper) const {
+        if (!lower.empty() && encodedUserKey(largestKey) < lower) return false;
+        if (!upper.empty() && encodedUserKey(smallestKey) >= upper) return false;
+        return true;
+    }
+
+    // Whether a key starting with prefix, given escaped as by encodedKeyPrefix(), may be
+    // here. Only a prefix at least prefixLength long can be checked against the filter.
+    bool mayContainPrefix(std::string_view prefix) const {
+        if (prefixLength == 0 || prefix.size() < prefixLength) return true;
+        return prefixFilter.possiblyContains(prefix.substr(0, prefixLength));
+    }
+};
+
+// Skip list height cap. With a 1-in-4 chance of growing a level this covers a few
+// million entries per memtable before searches degrade.
+const int MAX_LEVEL = 11;
+
+// L0 holds whole memtable flushes, which may overlap; from L1 down every level is a
+// set of files with disjoint key ranges, each level about 10x the size of the one above.
+const int NUM_LEVELS = 7;
+
+// Data blocks are cut once they reach this many bytes (Options::blockSize); a point
+// lookup reads exactly one. Index partitions are cut the same way.
+const size_t SSTABLE_BLOCK_SIZE = 4096;
+
+// v2 stores a full key every this many entries; the ones in between share a prefix with their predecessor.
+const int SSTABLE_RESTART_INTERVAL = 16;
+
+// SSTable format versions. v1 has no magic and an 8-byte [indexOffset][bloomOffset]
+// footer, fixed 4-byte lengths, a flat index of every few records and bare user keys.
+// v1 tables are rewritten as v2 on open.
+// v2 stores internal keys in prefix-compressed data blocks with restart points and
+// follows every block with [compression type u8][crc32c u32], a CRC32C of the block as
+// stored plus the type byte; index sizes exclude that trailer. After the data blocks
+// come [index partition][filter]..., each partition a block of data block first key ->
+// [offset varint64][size varint32] and the filter a blocked Bloom filter over the
+// encoded user keys of those blocks. Then the top-level index, entries of [KeyLen][Key]
+// [Offset][Size][FilterOffset][FilterSize] as varints, which the footer's index offset
+// points at, and at the bloom offset [prefixLength u32] and, if that is not 0, a filter
+// over the key prefixes of that length. Both carry the block trailer too. The footer is
+// [indexOffset u64][bloomOffset u64][version u32][magic u64].
+const uint32_t SSTABLE_FORMAT_V1 = 1;
+const uint32_t SSTABLE_FORMAT_V2 = 2;
+const uint32_t SSTABLE_FORMAT_CURRENT = SSTABLE_FORMAT_V2;
+const uint64_t SSTABLE_MAGIC = 0x4C534D5441424C45ULL; // "LSMTABLE"
+
+// Bytes stored after each block's payload, which index sizes exclude.
+inline size_t blockTrailerSize(uint32_t version) {
+    return version == SSTABLE_FORMAT_V1 ? 0 : 5;
+}
+
+// Whether a v2 block, read with its trailer, matches its checksum.
+inline bool blockChecksumMatches(std::string_view stored, uint32_t size) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(stored.data());
+    return crc32c(data, size + 1) == getFixed32(data + size + 1);
+}
+
+// --- Data Blocks ---
+// v1: [KeyLen][Key][ValLen][Val]... with fixed 4-byte lengths.
+// v2: [shared][nonShared][ValLen][KeyDelta][Val]... with varint lengths, then
+//     [restart offset]...[numRestarts] as fixed 4-byte values.
+
+class BlockBuilder {
+private:
+    Buffer buffer;
+    std::vector<uint32_t> restarts;
+    int counter = 0;
+    std::string lastKey;
+
+public:
+    BlockBuilder() { restarts.push_back(0); }
+
+    bool empty() const { return buffer.empty(); }
+
+    size_t estimatedSize() const { return buffer.size() + (restarts.size() + 1) * 4; }
+
+    void add(std::string_view key, std::string_view value) {
+        size_t shared = 0;
+        if (counter < SSTABLE_RESTART_INTERVAL) {
+            size_t limit = std::min(lastKey.size(), key.size());
+            while (shared < limit && lastKey[shared] == key[shared]) shared++;
+        } else {
+            restarts.push_back(static_cast<uint32_t>(buffer.size()));
+            counter = 0;
+        }
+        size_t nonShared = key.size() - shared;
+
+        encodeVarint32(buffer, static_cast<uint32_t>(shared));
+        encodeVarint32(buffer, static_cast<uint32_t>(nonShared));
+        encodeVarint32(buffer, static_cast<uint32_t>(value.size()));
+        buffer.insert(buffer.end(), key.begin() + shared, key.end());
+        buffer.insert(buffer.end(), value.begin(), value.end());
+
+        lastKey.assign(key.data(), key.size());
+        counter++;
+    }
+
+    // Appends the restart array and returns the finished block; the builder is reset.
+    Buffer finish() {
+        for (uint32_t r : restarts) encodeLength(buffer, r);
+        encodeLength(buffer, static_cast<uint32_t>(restarts.size()));
+        Buffer out;
+        out.swap(buffer);
+        restarts.assign(1, 0);
+        counter = 0;
+        lastKey.clear();
+        return out;
+    }
+};
+
+// Walks one data block in place. Values are views into the block; in v2 the key is
+// rebuilt in a scratch string, so a key() view is only good until the next move.
+class BlockIterator {
+private:
+    std::string_view data; // entries only, restart array excluded
+    std::string_view restartArray;
+    uint32_t numRestarts = 0;
+    uint32_t version;
+
+    size_t entryOffset = 0;
+    size_t nextOffset = 0;
+    bool atEntry = false;
+    std::string keyBuf;
+    std::string_view keyView;
+    std::string_view val;
+
+    bool parseNext() {
+        atEntry = false;
+        if (nextOffset >= data.size()) return false;
+        entryOffset = nextOffset;
+        try {
+            if (version == SSTABLE_FORMAT_V1) {
+                uint32_t kLen = decodeLength(data, nextOffset);
+                keyView = decodeView(data, nextOffset, kLen);
+                uint32_t vLen = decodeLength(data, nextOffset);
+                val = decodeView(data, nextOffset, vLen);
+            } else {
+                uint32_t shared = decodeVarint32(data, nextOffset);
+                uint32_t nonShared = decodeVarint32(data, nextOffset);
+                uint32_t vLen = decodeVarint32(data, nextOffset);
+                if (shared > keyBuf.size()) throw std::runtime_error("bad shared prefix");
+                std::string_view delta = decodeView(data, nextOffset, nonShared);
+                val = decodeView(data, nextOffset, vLen);
+                keyBuf.resize(shared);
+                keyBuf.append(delta.data(), delta.size());
+                keyView = keyBuf;
+            }
+        } catch (...) {
+            nextOffset = data.size();
+            return false;
+        }
+        atEntry = true;
+        return true;
+    }
+
+    uint32_t restartPoint(uint32_t i) const {
+        return getFixed32(reinterpret_cast<const uint8_t*>(restartArray.data()) + i * 4);
+    }
+
+    void seekToRestart(uint32_t i) {
+        keyBuf.clear();
+        nextOffset = restartPoint(i);
+        parseNext();
+    }
+
+public:
+    BlockIterator(std::string_view block, uint32_t formatVersion) : version(formatVersion) {
+        if (version == SSTABLE_FORMAT_V1) {
+            data = block;
+            return;
+        }
+        if (block.size() < 4) return;
+        size_t tail = block.size() - 4;
+        numRestarts = decodeLength(block, tail);
+        if (numRestarts == 0 || (block.size() - 4) / 4 < numRestarts) {
+            numRestarts = 0;
+            return;
+        }
+        size_t restartStart = block.size() - 4 - numRestarts * 4;
+        data = block.substr(0, restartStart);
+        restartArray = block.substr(restartStart, numRestarts * 4);
+    }
+
+    bool valid() const { return atEntry; }
+    std::string_view key() const { return keyView; }
+    std::string_view value() const { return val; }
+
+    void seekToFirst() {
+        keyBuf.clear();
+        nextOffset = 0;
+        parseNext();
+    }
+
+    void next() { parseNext(); }
+
+    void seekToLast() {
+        if (numRestarts > 0) {
+            seekToRestart(numRestarts - 1);
+        } else {
+            seekToFirst();
+        }
+        while (atEntry && nextOffset < data.size()) parseNext();
+    }
+
+    // Entries only link forward, so this restarts from the last restart point before
+    // the current entry and walks up to the one in front of it.
+    void prev() {
+        size_t target = entryOffset;
+        if (target == 0) {
+            atEntry = false;
+            nextOffset = data.size();
+            return;
+        }
+        uint32_t r = numRestarts > 0 ? numRestarts - 1 : 0;
+        while (r > 0 && restartPoint(r) >= target) r--;
+        if (numRestarts > 0) {
+            seekToRestart(r);
+        } else {
+            seekToFirst();
+        }
+        while (atEntry && nextOffset < target) parseNext();
+    }
+
+    // Positions at the first entry whose key is >= target.
+    void seek(std::string_view target) {
+        if (numRestarts > 0) {
+            // Last restart point whose key is < target; every restart key is stored whole.
+            uint32_t left = 0, right = numRestarts - 1;
+            while (left < right) {
+                uint32_t mid = (left + right + 1) / 2;
+                seekToRestart(mid);
+                if (atEntry && keyView < target) left = mid;
+                else right = mid - 1;
+            }
+            seekToRestart(left);
+        } else {
+            seekToFirst();
+        }
+        while (atEntry && keyView < target) parseNext();
+    }
+};
+
+// --- Block Compression ---
+// Both codecs emit the same LZ77 stream (LZ4-style sequences), prefixed with the
+// varint uncompressed length, so one decoder serves both:
+//   [token: literalLen(4) | matchLen-4 (4)][literalLen ext][literals][offset (2, LE)][matchLen ext]
+// LZFast takes the first hash hit; LZStrong walks a hash chain for the longest match.
+
+enum class CompressionType : uint8_t {
+    None = 0,
+    LZFast = 1,
+    LZStrong = 2,
+};
+
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 65535;
+const int LZ_HASH_BITS = 14;
+const int LZ_STRONG_MAX_CHAIN = 64;
+
+inline uint32_t lzHash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+inline void lzWriteLengthExt(Buffer& out, size_t len) {
+    while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back(static_cast<uint8_t>(len));
+}
+
+inline void lzEmitSequence(Buffer& out, const uint8_t* literals, size_t literalLen, size_t offset, size_t matchLen) {
+    size_t m = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    uint8_t token = static_cast<uint8_t>((std::min<size_t>(literalLen, 15) << 4) | std::min<size_t>(m, 15));
+    out.push_back(token);
+    if (literalLen >= 15) lzWriteLengthExt(out, literalLen - 15);
+    out.insert(out.end(), literals, literals + literalLen);
+    if (matchLen == 0) return; // final literals-only sequence
+    out.push_back(static_cast<uint8_t>(offset & 0xFF));
+    out.push_back(static_cast<uint8_t>(offset >> 8));
+    if (m >= 15) lzWriteLengthExt(out, m - 15);
+}
+
+inline void lzCompress(std::string_view input, Buffer& out, bool strong) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(input.data());
+    size_t n = input.size();
+    encodeVarint32(out, static_cast<uint32_t>(n));
+
+    // Per-thread match tables, kept across calls so a block does not pay for clearing
+    // 64 KiB. head holds base + position; entries below base are from earlier calls.
+    // chain[p] is always written before it is read, so it is never cleared.
+    thread_local std::vector<uint32_t> head(1 << LZ_HASH_BITS, 0);
+    thread_local std::vector<int32_t> chain;
+    thread_local uint32_t base = 1;
+    if (n >= UINT32_MAX - base) {
+        std::fill(head.begin(), head.end(), 0);
+        base = 1;
+    }
+    if (strong && chain.size() < n) chain.resize(n);
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    // Matches never run into the last bytes so the hash read stays in bounds.
+    size_t limit = n >= LZ_MIN_MATCH ? n - LZ_MIN_MATCH : 0;
+
+    auto insertHash = [&](size_t p) {
+        uint32_t h = lzHash(src + p);
+        if (strong) chain[p] = head[h] >= base ? static_cast<int32_t>(head[h] - base) : -1;
+        head[h] = base + static_cast<uint32_t>(p);
+    };
+
+    while (pos < limit) {
+        uint32_t h = lzHash(src + pos);
+        size_t bestLen = 0, bestOffset = 0;
+        int32_t candidate = head[h] >= base ? static_cast<int32_t>(head[h] - base) : -1;
+        int probes = strong ? LZ_STRONG_MAX_CHAIN : 1;
+
+        while (candidate >= 0 && probes-- > 0 && pos - candidate <= LZ_MAX_OFFSET) {
+            size_t len = 0;
+            while (pos + len < n && src[candidate + len] == src[pos + len]) len++;
+            if (len > bestLen) {
+                bestLen = len;
+                bestOffset = pos - candidate;
+            }
+            if (!strong) break;
+            candidate = chain[candidate];
+        }
+
+        insertHash(pos);
+        if (bestLen < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+
+        lzEmitSequence(out, src + anchor, pos - anchor, bestOffset, bestLen);
+        size_t end = pos + bestLen;
+        for (size_t p = pos + 1; p < end && p < limit; p++) insertHash(p);
+        pos = end;
+        anchor = pos;
+    }
+    lzEmitSequence(out, src + anchor, n - anchor, 0, 0);
+    base += static_cast<uint32_t>(n) + 1;
+}
+
+inline bool lzReadLengthExt(std::string_view in, size_t& offset, size_t& len) {
+    uint8_t byte;
+    do {
+        if (offset >= in.size()) return false;
+        byte = static_cast<uint8_t>(in[offset++]);
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+inline bool lzDecompress(std::string_view in, Buffer& out) {
+    size_t offset = 0;
+    uint32_t rawSize;
+    try {
+        rawSize = decodeVarint32(in, offset);
+    } catch (...) {
+        return false;
+    }
+    // A match byte expands to at most ~255 output bytes; anything bigger is corruption.
+    if (rawSize > (in.size() + 1) * 255) return false;
+    out.resize(rawSize);
+    uint8_t* dst = out.data();
+    size_t written = 0;
+
+    while (offset < in.size()) {
+        uint8_t token = static_cast<uint8_t>(in[offset++]);
+        size_t literalLen = token >> 4;
+        if (literalLen == 15 && !lzReadLengthExt(in, offset, literalLen)) return false;
+        if (literalLen > in.size() - offset || literalLen > rawSize - written) return false;
+        if (literalLen) memcpy(dst + written, in.data() + offset, literalLen);
+        offset += literalLen;
+        written += literalLen;
+        if (offset == in.size()) break;
+
+        if (in.size() - offset < 2) return false;
+        size_t matchOffset = static_cast<uint8_t>(in[offset]) | (static_cast<uint8_t>(in[offset + 1]) << 8);
+        offset += 2;
+        size_t matchLen = token & 0x0F;
+        if (matchLen == 15 && !lzReadLengthExt(in, offset, matchLen)) return false;
+        matchLen += LZ_MIN_MATCH;
+        if (matchOffset == 0 || matchOffset > written || matchLen > rawSize - written) return false;
+
+        // Byte-wise copy: a match may overlap the bytes it is producing.
+        const uint8_t* from = dst + written - matchOffset;
+        for (size_t i = 0; i < matchLen; i++) dst[written + i] = from[i];
+        written += matchLen;
+    }
+    return written == rawSize;
+}
+
+// Returns the type actually used; blocks that do not shrink by at least 1/8 are stored raw.
+inline CompressionType compressBlock(const Buffer& raw, CompressionType type, Buffer& out) {
+    if (type == CompressionType::None) return CompressionType::None;
+    out.clear();
+    lzCompress(asView(raw), out, type == CompressionType::LZStrong);
+    if (out.size() >= raw.size() - raw.size() / 8) return CompressionType::None;
+    return type;
+}
+
+inline bool uncompressBlock(std::string_view payload, CompressionType type, Buffer& out) {
+    switch (type) {
+        case CompressionType::LZFast:
+        case CompressionType::LZStrong:
+            return lzDecompress(payload, out);
+        default:
+            return false;
+    }
+}
+
+// Process-wide unique id per opened table, so cache entries never alias across
+// rewritten files that reuse a name (e.g. L1_merged.sst).
+inline uint64_t newTableId() {
+    static std::atomic<uint64_t> nextId{1};
+    return nextId.fetch_add(1);
+}
+
+// --- Block Cache ---
+// Sharded LRU of data blocks keyed by (table id, block offset); capacity is in bytes.
+
+class BlockCache {
+public:
+    using Handle = std::shared_ptr<const Buffer>;
+
+private:
+    struct CacheKey {
+        uint64_t fileId;
+        uint64_t offset;
+        bool operator==(const CacheKey& o) const { return fileId == o.fileId && offset == o.offset; }
+    };
+
+    struct CacheKeyHash {
+        size_t operator()(const CacheKey& k) const {
+            uint64_t h = k.fileId * 0x9E3779B97F4A7C15ULL ^ (k.offset + 0x632BE59BD9B4E019ULL + (k.fileId << 6));
+            return static_cast<size_t>(h ^ (h >> 29));
+        }
+    };
+
+    struct Entry {
+        CacheKey key;
+        Handle block;
+        size_t charge;
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::list<Entry> lru; // front = most recently used
+        std::unordered_map<CacheKey, std::list<Entry>::iterator, CacheKeyHash> table;
+        size_t usage = 0;
+        size_t capacity = 0;
+    };
+
+    std::vector<Shard> shards;
+    std::atomic<uint64_t> hitCount{0};
+    std::atomic<uint64_t> missCount{0};
+    std::atomic<uint64_t> evictionCount{0};
+
+    Shard& shardFor(const CacheKey& key) {
+        return shards[CacheKeyHash()(key) % shards.size()];
+    }
+
+public:
+    explicit BlockCache(size_t capacityBytes, int numShards = 16) : shards(numShards > 0 ? numShards : 1) {
+        for (auto& shard : shards) shard.capacity = capacityBytes / shards.size();
+    }
+
+    Handle lookup(uint64_t fileId, uint64_t offset) {
+        CacheKey key{fileId, offset};
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.table.find(key);
+        if (it == shard.table.end()) {
+            missCount++;
+            return nullptr;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        hitCount++;
+        return it->second->block;
+    }
+
+    void insert(uint64_t fileId, uint64_t offset, Handle block) {
+        CacheKey key{fileId, offset};
+        size_t charge = block->size() + sizeof(Entry);
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        if (charge > shard.capacity) return;
+
+        auto it = shard.table.find(key);
+        if (it != shard.table.end()) {
+            shard.usage -= it->second->charge;
+            shard.lru.erase(it->second);
+            shard.table.erase(it);
+        }
+        while (shard.usage + charge > shard.capacity && !shard.lru.empty()) {
+            Entry& victim = shard.lru.back();
+            shard.usage -= victim.charge;
+            shard.table.erase(victim.key);
+            shard.lru.pop_back();
+            evictionCount++;
+        }
+        shard.lru.push_front({key, std::move(block), charge});
+        shard.table[key] = shard.lru.begin();
+        shard.usage += charge;
+    }
+
+    uint64_t hits() const { return hitCount.load(); }
+    uint64_t misses() const { return missCount.load(); }
+    uint64_t evictions() const { return evictionCount.load(); }
+
+    size_t usage() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mu);
+            total += shard.usage;
+        }
+        return total;
+    }
+};
+
+// A data block as seen by readers: its bytes plus whatever owns them
+// (a cache entry, a freshly read buffer, or the mapped file).
+struct BlockContents {
+    std::string_view data;
+    std::shared_ptr<const void> pin;
+
+    explicit operator bool() const { return pin != nullptr; }
+};
+
+// --- Write Batch ---
+// A group of puts and deletes that is logged as one WAL record and applied as a unit.
+// rep: [count u32]{[type][KeyLen varint][Key][ValLen varint][Val]}..., values omitted for deletes.
+
+enum class BatchOp : uint8_t {
+    Delete = 0,
+    Put = 1,
+};
+
+class WriteBatch {
+private:
+    Buffer rep;
+
+public:
+    WriteBatch() { clear(); }
+
+    void clear() { rep.assign(4, 0); }
+
+    uint32_t count() const { return getFixed32(rep.data()); }
+
+    size_t approximateSize() const { return rep.size(); }
+
+    std::string_view contents() const { return asView(rep); }
+
+    void put(std::string_view key, std::string_view value) {
+        putFixed32(rep.data(), count() + 1);
+        rep.push_back(static_cast<uint8_t>(BatchOp::Put));
+        encodeVarint32(rep, static_cast<uint32_t>(key.size()));
+        encodeBytes(rep, key);
+        encodeVarint32(rep, static_cast<uint32_t>(value.size()));
+        encodeBytes(rep, value);
+    }
+
+    void del(std::string_view key) {
+        putFixed32(rep.data(), count() + 1);
+        rep.push_back(static_cast<uint8_t>(BatchOp::Delete));
+        encodeVarint32(rep, static_cast<uint32_t>(key.size()));
+        encodeBytes(rep, key);
+    }
+
+    // Calls fn(op, key, value) for every entry of an encoded batch. Returns false if the
+    // encoding is malformed or the entry count does not match; fn may already have run
+    // for a prefix by then, so callers that need all-or-nothing validate first.
+    template <typename Fn>
+    static bool forEach(std::string_view data, Fn&& fn) {
+        try {
+            size_t offset = 0;
+            uint32_t expected = decodeLength(data, offset);
+            uint32_t seen = 0;
+            while (offset < data.size()) {
+                BatchOp op = static_cast<BatchOp>(data[offset++]);
+                uint32_t kLen = decodeVarint32(data, offset);
+                std::string_view key = decodeView(data, offset, kLen);
+                std::string_view value;
+                if (op == BatchOp::Put) {
+                    uint32_t vLen = decodeVarint32(data, offset);
+                    value = decodeView(data, offset, vLen);
+                } else if (op != BatchOp::Delete) {
+                    return false;
+                }
+                fn(op, key, value);
+                seen++;
+            }
+            return seen == expected;
+        } catch (...) {
+            return false;
+        }
+    }
+
+    static bool isValid(std::string_view data) {
+        return forEach(data, [](BatchOp, std::string_view, std::string_view) {});
+    }
+};
+
+// --- Write-Ahead Log ---
+// File: [magic u64] then one record per WriteBatch:
+// [payloadLen u32][crc32c(payload) u32][crc32c(first 8 header bytes) u32][payload],
+// where the payload is [first sequence u64][batch] and the batch's entries take
+// consecutive sequence numbers from there. The header has a checksum of its own so a
+// damaged length is told apart from a record cut off by a crash. Logs written before
+// batches existed have no magic and are a bare run of [KeyLen][Key][ValLen][Val] records.
+
+const uint64_t WAL_MAGIC = 0x4C534D57414C3032ULL; // "LSMWAL02"
+const size_t WAL_HEADER_SIZE = 8;
+const size_t WAL_RECORD_HEADER_SIZE = 12;
+
+inline void encodeWalRecord(Buffer& out, uint64_t sequence, std::string_view batch) {
+    size_t pos = out.size();
+    out.resize(pos + WAL_RECORD_HEADER_SIZE + 8);
+    putFixed32(out.data() + pos, static_cast<uint32_t>(8 + batch.size()));
+    putFixed64(out.data() + pos + WAL_RECORD_HEADER_SIZE, sequence);
+    encodeBytes(out, batch);
+    size_t payloadPos = pos + WAL_RECORD_HEADER_SIZE;
+    putFixed32(out.data() + pos + 4, crc32c(out.data() + payloadPos, out.size() - payloadPos));
+    putFixed32(out.data() + pos + 8, crc32c(out.data() + pos, 8));
+}
+
+// Whether the record header at p (WAL_RECORD_HEADER_SIZE bytes) matches its checksum.
+inline bool walRecordHeaderMatches(const uint8_t* p) {
+    return crc32c(p, 8) == getFixed32(p + 8);
+}
+
+// What to do with a WAL record that fails its checksum or does not decode. A torn
+// write is what a crash mid-append leaves: a header cut short, an intact header whose
+// payload runs past the end of its segment, or a bad record followed only by zeros.
+// Anything else, a damaged length in the middle of a log included, is corruption.
+enum class WalRecoveryMode {
+    PointInTime,      // keep everything before the first bad record, drop it and all after
+    TolerateTornTail, // drop a torn write at the end of the newest segment; anything else fails the open
+};
+
+// Which block reads check the v2 block checksums. Whatever the mode, KVStore::scrub()
+// and the background scrubber (Options::scrubIntervalMs) check every block.
+enum class ChecksumMode {
+    Always,         // every block read from disk, by lookups, scans and compaction
+    CompactionOnly, // compaction reads only, so corruption is not copied into new tables
+    Never,
+};
+
+// Thrown by a lookup whose search reaches a block that fails its checksum or cannot be
+// read: older versions further down may be stale, so there is no answer to give.
+class CorruptionError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+enum class WalSyncMode {
+    NoSync,       // write() only: survives a process crash, not a power loss
+    SyncPerBatch, // fdatasync after every group commit before acknowledging it
+    SyncInterval, // a background thread fdatasyncs every walSyncIntervalMs
+};
+
+inline bool writeFully(int fd, const uint8_t* src, size_t n) {
+    while (n > 0) {
+        ssize_t w = ::write(fd, src, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        src += w;
+        n -= w;
+    }
+    return true;
+}
+
+// Makes the entries created or renamed in dir durable.
+inline bool syncDirectory(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Append-only log file written with plain write(2). In SyncInterval mode it owns a
+// thread that syncs whatever was appended since the last tick.
+class WALWriter {
+private:
+    int fd = -1;
+    WalSyncMode mode = WalSyncMode::NoSync;
+    int syncIntervalMs = 100;
+    std::atomic<bool> dirty{false};
+
+    std::thread syncThread;
+    std::mutex syncMutex;
+    std::condition_variable syncCv;
+    bool stopping = false;
+
+    void syncLoop() {
+        std::unique_lock<std::mutex> lock(syncMutex);
+        while (!stopping) {
+            syncCv.wait_for(lock, std::chrono::milliseconds(syncIntervalMs));
+            if (dirty.exchange(false) && fd >= 0) ::fdatasync(fd);
+        }
+    }
+
+public:
+    WALWriter() = default;
+    WALWriter(const WALWriter&) = delete;
+    WALWriter& operator=(const WALWriter&) = delete;
+    ~WALWriter() { close(); }
+
+    bool open(const std::string& filename, bool truncate, WalSyncMode syncMode, int intervalMs) {
+        close();
+        int flags = O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0);
+        fd = ::open(filename.c_str(), flags, 0644);
+        if (fd < 0) return false;
+
+        if (::lseek(fd, 0, SEEK_END) == 0) {
+            Buffer header(WAL_HEADER_SIZE);
+            putFixed64(header.data(), WAL_MAGIC);
+            mode = WalSyncMode::NoSync;
+            if (!append(header)) {
+                close();
+                return false;
+            }
+        }
+
+        mode = syncMode;
+        syncIntervalMs = intervalMs > 0 ? intervalMs : 1;
+        if (mode == WalSyncMode::SyncInterval) {
+            stopping = false;
+            syncThread = std::thread(&WALWriter::syncLoop, this);
+        }
+        return true;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Makes everything appended so far durable, whatever the sync mode.
+    bool sync() {
+        if (fd < 0 || ::fdatasync(fd) != 0) return false;
+        dirty = false;
+        return true;
+    }
+
+    // Appends one group of records and, in SyncPerBatch mode, makes it durable.
+    bool append(const Buffer& data) {
+        if (fd < 0 || !writeFully(fd, data.data(), data.size())) return false;
+        if (mode == WalSyncMode::SyncPerBatch) return ::fdatasync(fd) == 0;
+        dirty = true;
+        return true;
+    }
+
+    void close() {
+        if (syncThread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(syncMutex);
+                stopping = true;
+            }
+            syncCv.notify_one();
+            syncThread.join();
+        }
+        if (fd >= 0) {
+            if (mode != WalSyncMode::NoSync && dirty.exchange(false)) ::fdatasync(fd);
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
+
+// --- Rate Limiter ---
+// Token bucket for compaction writes. The bucket refills at bytesPerSecond and holds at
+// most 100 ms worth. A request may overdraw it; the caller then sleeps until the debt
+// is paid, so concurrent callers queue up behind each other fairly.
+
+class RateLimiter {
+private:
+    std::mutex mutex;
+    double bytesPerSecond;
+    double capacity;
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
+
+public:
+    explicit RateLimiter(uint64_t rate)
+        : bytesPerSecond(static_cast<double>(rate)), capacity(rate / 10.0), tokens(rate / 10.0),
+          lastRefill(std::chrono::steady_clock::now()) {}
+
+    void request(size_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+        lastRefill = now;
+        tokens = std::min(capacity, tokens + elapsed * bytesPerSecond);
+        tokens -= bytes;
+        if (tokens >= 0) return;
+
+        std::chrono::duration<double> wait(-tokens / bytesPerSecond);
+        lock.unlock();
+        std::this_thread::sleep_for(wait);
+    }
+};
+
+// --- Options ---
+
+struct Options {
+    // Shared across stores when set; otherwise each store gets its own cache of blockCacheSize bytes.
+    std::shared_ptr<BlockCache> blockCache;
+    size_t blockCacheSize = 8 * 1024 * 1024;
+
+    // Upper bound on SSTables kept open by the table cache.
+    size_t maxOpenFiles = 256;
+
+    // Map SSTables into memory and serve blocks as views of the mapping instead of
+    // pread + block cache.
+    bool useMmapReads = false;
+
+    // Scans (iterators and compaction) that read a table's blocks in order ask the OS
+    // to prefetch ahead of them, with a window that starts at 16 KiB and doubles up to
+    // this many bytes. 0 turns readahead off.
+    size_t readaheadSize = 256 * 1024;
+
+    // Codec for data blocks. compressionPerLevel, when non-empty, overrides it by level
+    // (levels past the end use the last entry), e.g. {LZFast, LZStrong} for L0 and L1.
+    CompressionType compression = CompressionType::LZFast;
+    std::vector<CompressionType> compressionPerLevel;
+
+    // Bloom filter bits per key in new tables (about 1% false positives at 10; 0 writes
+    // no filter). bloomBitsPerKeyPerLevel overrides it by level like compressionPerLevel,
+    // e.g. more bits for L0, whose files are all probed on a miss.
+    int bloomBitsPerKey = 10;
+    std::vector<int> bloomBitsPerKeyPerLevel;
+
+    // When not 0, new tables also get a filter over the first prefixBloomLength bytes of
+    // each key, with the same bits per key. Scans given a ReadOptions::prefix at least
+    // this long skip the tables whose filter rules the prefix out.
+    uint32_t prefixBloomLength = 0;
+
+    // Data blocks are cut at about blockSize bytes and the index has one entry per
+    // block, so this is also the index interval: larger blocks, smaller index. The index
+    // is stored in partitions of about indexPartitionSize bytes, each with the Bloom
+    // filter for its blocks. Only the small top-level index over the partitions stays in
+    // memory; partitions and filters are loaded through the block cache on demand.
+    size_t blockSize = SSTABLE_BLOCK_SIZE;
+    size_t indexPartitionSize = SSTABLE_BLOCK_SIZE;
+    // Keep the filters of L0 tables in memory anyway: a miss probes every L0 file, and
+    // L0 is a small, bounded part of the data.
+    bool pinL0Filters = true;
+
+    // Once the active memtable holds this many bytes it is swapped out as immutable and
+    // flushed to an L0 table on the background thread.
+    size_t memtableSize = 4 * 1024 * 1024;
+
+    // Leveled compaction. L0 is compacted into L1 once it holds level0CompactionTrigger
+    // files; L1 may hold level1MaxBytes and each deeper level levelSizeMultiplier times
+    // more. Compaction output is cut into files of about maxFileSize bytes.
+    int level0CompactionTrigger = 4;
+    uint64_t level1MaxBytes = 10 * 1024 * 1024;
+    int levelSizeMultiplier = 10;
+    uint64_t maxFileSize = 2 * 1024 * 1024;
+
+    // Threads running background compactions, and the cap on the bytes per second they
+    // write (0 = unlimited) so they do not starve foreground I/O.
+    int maxBackgroundCompactions = 2;
+    uint64_t compactionRateLimit = 0;
+
+    // A compaction this large is split along block boundaries into up to this many key
+    // ranges, merged on their own threads and installed together.
+    int maxSubcompactions = 4;
+
+    // Write backpressure when compaction falls behind: at level0SlowdownTrigger L0
+    // files each write group is delayed by 1 ms; at level0StopTrigger writes wait for
+    // compaction once the memtable is full.
+    int level0SlowdownTrigger = 8;
+    int level0StopTrigger = 12;
+
+    // WAL durability. Concurrent put()/del() calls are group-committed either way; the
+    // mode decides whether and when each group is fdatasync'ed.
+    WalSyncMode walSyncMode = WalSyncMode::NoSync;
+    int walSyncIntervalMs = 100;
+
+    // Recovery on open checks and replays the log segments on this many threads
+    // (0 = one per core), each segment into its own memtable, written straight to L0.
+    WalRecoveryMode walRecoveryMode = WalRecoveryMode::PointInTime;
+    int walRecoveryThreads = 0;
+
+    // Block checksum verification. A block that fails its checksum is treated as
+    // unreadable. When scrubIntervalMs is not 0, a background thread runs scrub() that
+    // often, reading every block of the live tables past the cache.
+    ChecksumMode checksumMode = ChecksumMode::Always;
+    int scrubIntervalMs = 0;
+
+    CompressionType compressionForLevel(int level) const {
+        if (compressionPerLevel.empty()) return compression;
+        size_t i = std::min<size_t>(level, compressionPerLevel.size() - 1);
+        return compressionPerLevel[i];
+    }
+
+    int bloomBitsForLevel(int level) const {
+        if (bloomBitsPerKeyPerLevel.empty()) return bloomBitsPerKey;
+        size_t i = std::min<size_t>(level, bloomBitsPerKeyPerLevel.size() - 1);
+        return bloomBitsPerKeyPerLevel[i];
+    }
+};
+
+// A point in the write history, from KVStore::getSnapshot(). Reads given one see the
+// store as it was then, and compaction keeps the versions they need until the snapshot
+// is handed back with releaseSnapshot().
+class Snapshot {
+    friend class KVStore;
+    uint64_t seq;
+    explicit Snapshot(uint64_t sequence) : seq(sequence) {}
+
+public:
+    uint64_t sequence() const { return seq; }
+};
+
+struct ReadOptions {
+    // Read as of this snapshot; nullptr reads the latest state.
+    const Snapshot* snapshot = nullptr;
+
+    // Limits newIterator() to user keys in [lowerBound, upperBound); empty means no
+    // bound. Tables whose key range lies outside are not read at all.
+    std::string lowerBound;
+    std::string upperBound;
+    // Limits newIterator() to keys starting with prefix, on top of the bounds. Tables
+    // are also skipped when their prefix filter (Options::prefixBloomLength) rules it out.
+    std::string prefix;
+};
+
+// --- Block I/O ---
+
+inline bool preadFully(int fd, uint8_t* dst, size_t n, uint64_t offset) {
+    while (n > 0) {
+        ssize_t r = ::pread(fd, dst, n, static_cast<off_t>(offset));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        dst += r;
+        n -= r;
+        offset += r;
+    }
+    return true;
+}
+
+// Read-only SSTable handle. Either positional reads on an fd, or the whole file
+// mapped so blocks can be handed out as views; unmapped/closed with the last reference.
+class RandomAccessFile {
+private:
+    int fd;
+    uint64_t fileSize;
+    const uint8_t* mapping = nullptr;
+
+public:
+    RandomAccessFile(int f, uint64_t size, const uint8_t* mapped)
+        : fd(f), fileSize(size), mapping(mapped) {}
+    RandomAccessFile(const RandomAccessFile&) = delete;
+    RandomAccessFile& operator=(const RandomAccessFile&) = delete;
+
+    ~RandomAccessFile() {
+        if (mapping) ::munmap(const_cast<uint8_t*>(mapping), fileSize);
+        ::close(fd);
+    }
+
+    static std::shared_ptr<RandomAccessFile> open(const std::string& filename, bool useMmap) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        off_t size = ::lseek(fd, 0, SEEK_END);
+        if (size < 0) {
+            ::close(fd);
+            return nullptr;
+        }
+
+        const uint8_t* mapped = nullptr;
+        if (useMmap && size > 0) {
+            void* p = ::mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) mapped = static_cast<const uint8_t*>(p);
+        }
+        return std::make_shared<RandomAccessFile>(fd, static_cast<uint64_t>(size), mapped);
+    }
+
+    uint64_t size() const { return fileSize; }
+    bool isMapped() const { return mapping != nullptr; }
+
+    // Only valid when isMapped().
+    std::string_view view(uint64_t offset, size_t n) const {
+        if (offset > fileSize || n > fileSize - offset) return std::string_view();
+        return std::string_view(reinterpret_cast<const char*>(mapping) + offset, n);
+    }
+
+    // Asks the kernel to start fetching [offset, offset + n) ahead of the reads for it.
+    void readahead(uint64_t offset, size_t n) const {
+        if (offset >= fileSize) return;
+        n = static_cast<size_t>(std::min<uint64_t>(n, fileSize - offset));
+        if (mapping) {
+            uint64_t pageSize = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+            uint64_t start = offset / pageSize * pageSize;
+            ::madvise(const_cast<uint8_t*>(mapping) + start, offset + n - start, MADV_WILLNEED);
+        } else {
+            ::posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(n), POSIX_FADV_WILLNEED);
+        }
+    }
+
+    bool read(uint64_t offset, size_t n, uint8_t* dst) const {
+        if (mapping) {
+            if (offset > fileSize || n > fileSize - offset) return false;
+            memcpy(dst, mapping + offset, n);
+            return true;
+        }
+        return preadFully(fd, dst, n, offset);
+    }
+};
+
+// --- Table Cache ---
+// Keeps up to maxOpenFiles SSTables open (LRU), keyed by the table id in SSTableMetadata.
+
+class TableCache {
+private:
+    struct Entry {
+        uint64_t fileId;
+        std::shared_ptr<RandomAccessFile> file;
+    };
+
+    std::mutex mu;
+    size_t capacity;
+    std::list<Entry> lru; // front = most recently used
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> table;
+    bool useMmap;
+
+public:
+    TableCache(size_t maxOpenFiles, bool mmapReads)
+        : capacity(maxOpenFiles > 0 ? maxOpenFiles : 1), useMmap(mmapReads) {}
+
+    // Files are opened, mapped, unmapped and closed outside mu, so a slow open does not
+    // hold up readers of tables that are already open. Two threads missing on the same
+    // table may both open it; the first to insert wins and the other copy is closed.
+    std::shared_ptr<RandomAccessFile> get(const SSTableMetadata& meta) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            auto it = table.find(meta.fileId);
+            if (it != table.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                return it->second->file;
+            }
+        }
+
+        auto file = RandomAccessFile::open(meta.filename, useMmap);
+        if (!file) return nullptr;
+
+        std::list<Entry> evicted;
+        std::lock_guard<std::mutex> lock(mu);
+        auto it = table.find(meta.fileId);
+        if (it != table.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->file;
+        }
+        while (lru.size() >= capacity) {
+            table.erase(lru.back().fileId);
+            evicted.splice(evicted.begin(), lru, std::prev(lru.end()));
+        }
+        lru.push_front({meta.fileId, file});
+        table[meta.fileId] = lru.begin();
+        return file;
+    }
+
+    void evict(uint64_t fileId) {
+        std::list<Entry> evicted;
+        std::lock_guard<std::mutex> lock(mu);
+        auto it = table.find(fileId);
+        if (it == table.end()) return;
+        evicted.splice(evicted.begin(), lru, it->second);
+        table.erase(it);
+    }
+};
+
+// --- SSTable Footer ---
+
+struct SSTableFooter {
+    uint32_t version = SSTABLE_FORMAT_V1;
+    uint64_t indexOffset = 0;
+    uint64_t bloomOffset = 0;
+    uint64_t size = 0; // bytes the footer takes at the end of the file
+};
+
+// v1: [indexOffset u32][bloomOffset u32]
+// v2: [indexOffset u64][bloomOffset u64][version u32][magic u64]
+const size_t SSTABLE_FOOTER_V1_SIZE = 8;
+const size_t SSTABLE_FOOTER_V2_SIZE = 28;
+const size_t SSTABLE_FOOTER_TAIL_SIZE = 12; // [version][magic]
+
+inline void encodeFooter(Buffer& buffer, uint64_t indexOffset, uint64_t bloomOffset) {
+    size_t pos = buffer.size();
+    buffer.resize(pos + SSTABLE_FOOTER_V2_SIZE);
+    uint8_t* dst = buffer.data() + pos;
+    putFixed64(dst, indexOffset);
+    putFixed64(dst + 8, bloomOffset);
+    putFixed32(dst + 16, SSTABLE_FORMAT_CURRENT);
+    putFixed64(dst + 20, SSTABLE_MAGIC);
+}
+
+// A file whose last 8 bytes are not the magic is a v1 table.
+inline bool readFooter(const RandomAccessFile& file, SSTableFooter& footer) {
+    uint64_t fileSize = file.size();
+    uint8_t tail[SSTABLE_FOOTER_V2_SIZE];
+    size_t tailSize = static_cast<size_t>(std::min<uint64_t>(fileSize, SSTABLE_FOOTER_V2_SIZE));
+    if (tailSize < SSTABLE_FOOTER_V1_SIZE || !file.read(fileSize - tailSize, tailSize, tail)) return false;
+    const uint8_t* end = tail + tailSize;
+
+    if (tailSize >= SSTABLE_FOOTER_TAIL_SIZE && getFixed64(end - 8) == SSTABLE_MAGIC) {
+        footer.version = getFixed32(end - SSTABLE_FOOTER_TAIL_SIZE);
+        if (footer.version != SSTABLE_FORMAT_V2) return false;
+
+        footer.size = SSTABLE_FOOTER_V2_SIZE;
+        if (tailSize < footer.size) return false;
+        const uint8_t* start = end - footer.size;
+        footer.indexOffset = getFixed64(start);
+        footer.bloomOffset = getFixed64(start + 8);
+    } else {
+        footer.version = SSTABLE_FORMAT_V1;
+        footer.indexOffset = getFixed32(end - 8);
+        footer.bloomOffset = getFixed32(end - 4);
+        footer.size = SSTABLE_FOOTER_V1_SIZE;
+        // The v1 index follows the data and points into it, so with no data there is no
+        // index either. A v2 table cut short at a field boundary reads as exactly that: the
+        // zero high word of an offset as the index offset.
+        if (footer.indexOffset == 0 && footer.bloomOffset != 0) return false;
+    }
+    return footer.indexOffset <= footer.bloomOffset && footer.bloomOffset <= fileSize - footer.size;
+}
+
+// --- SSTable Writer ---
+// Layout: [Data Block]...[Data Block][Index Partition][Filter]...[Top-Level Index][Prefix Filter][Footer]
+// Always writes the current format version, so keys must be internal keys.
+
+class SSTableBuilder {
+private:
+    int fd;
+    // Set by the first failed write; finish() then reports failure.
+    bool failed = false;
+    std::string filename;
+    BlockBuilder block;
+    std::string blockFirstKey;
+    std::string firstKey;
+    std::string lastKey;
+    uint64_t currentOffset = 0;
+    std::vector<IndexEntry> index;
+    // Bloom filter input, one hash per user key and data block it appears in, so each
+    // index partition's filter covers every key in its blocks. blockHashEnd[i] is where
+    // block i's hashes end. Filters are sized from the final counts in finish().
+    std::vector<uint64_t> keyHashes;
+    std::vector<size_t> blockHashEnd;
+    int bloomBitsPerKey;
+    // Same for the prefix filter, which covers the whole table; sorted keys bring each
+    // prefix up in one run.
+    uint32_t prefixLength;
+    std::vector<uint64_t> prefixHashes;
+    std::string lastPrefix;
+
+    CompressionType compression;
+    size_t blockSize;
+    size_t indexPartitionSize;
+    Buffer compressed;
+    RateLimiter* rateLimiter;
+
+    // Writes [payload][compression type][crc32c] and returns where the payload went.
+    std::pair<uint64_t, uint32_t> writeBlock(Buffer& payload, CompressionType type) {
+        uint64_t offset = currentOffset;
+        uint32_t size = static_cast<uint32_t>(payload.size());
+        payload.push_back(static_cast<uint8_t>(type));
+        uint32_t checksum = crc32c(payload.data(), payload.size());
+        payload.resize(payload.size() + 4);
+        putFixed32(payload.data() + size + 1, checksum);
+        if (rateLimiter) rateLimiter->request(payload.size());
+        append(payload);
+        return {offset, size};
+    }
+
+    void append(const Buffer& data) {
+        if (!failed && !writeFully(fd, data.data(), data.size())) failed = true;
+        currentOffset += data.size();
+    }
+
+    // The index entry records the payload size only.
+    void flushBlock() {
+        if (block.empty()) return;
+        Buffer contents = block.finish();
+        CompressionType type = compressBlock(contents, compression, compressed);
+        Buffer& payload = (type == CompressionType::None) ? contents : compressed;
+        auto [offset, size] = writeBlock(payload, type);
+        index.push_back({blockFirstKey, offset, size});
+        blockHashEnd.push_back(keyHashes.size());
+    }
+
+    // Writes the index partition for blocks [first, last) and then their filter.
+    IndexPartition writePartition(BlockBuilder& indexBlock, size_t first, size_t last) {
+        IndexPartition partition;
+        partition.key = index[first].key;
+        Buffer contents = indexBlock.finish();
+        std::tie(partition.offset, partition.size) = writeBlock(contents, CompressionType::None);
+
+        size_t hashStart = first == 0 ? 0 : blockHashEnd[first - 1];
+        BloomFilter bf(blockHashEnd[last - 1] - hashStart, bloomBitsPerKey);
+        for (size_t i = hashStart; i < blockHashEnd[last - 1]; i++) bf.addHash(keyHashes[i]);
+        Buffer filter;
+        bf.serialize(filter);
+        std::tie(partition.filterOffset, partition.filterSize) = writeBlock(filter, CompressionType::None);
+        return partition;
+    }
+
+public:
+    // Settings for a table at level: codec, filter bits and prefix, block and index
+    // partition sizes.
+    SSTableBuilder(const std::string& name, const Options& options, int level, RateLimiter* limiter = nullptr)
+        : fd(::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)), filename(name),
+          bloomBitsPerKey(options.bloomBitsForLevel(level)), prefixLength(options.prefixBloomLength),
+          compression(options.compressionForLevel(level)), blockSize(options.blockSize),
+          indexPartitionSize(options.indexPartitionSize), rateLimiter(limiter) {}
+    SSTableBuilder(const SSTableBuilder&) = delete;
+    SSTableBuilder& operator=(const SSTableBuilder&) = delete;
+    ~SSTableBuilder() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Bytes of data blocks written so far plus the block being built.
+    uint64_t estimatedSize() const { return currentOffset + block.estimatedSize(); }
+
+    void add(std::string_view key, std::string_view value) {
+        // Versions of one user key are adjacent; a filter only needs it once.
+        bool newUserKey = lastKey.empty() || encodedUserKey(key) != encodedUserKey(lastKey);
+        if (newUserKey || block.empty()) keyHashes.push_back(BloomFilter::hashKey(encodedUserKey(key)));
+        if (newUserKey && prefixLength > 0) {
+            std::string_view prefix = encodedKeyPrefix(encodedUserKey(key), prefixLength);
+            if (prefixHashes.empty() || prefix != lastPrefix) {
+                prefixHashes.push_back(BloomFilter::hashKey(prefix));
+                lastPrefix = prefix;
+            }
+        }
+        if (block.empty()) blockFirstKey = key;
+        if (index.empty() && block.empty()) firstKey = key;
+        lastKey = key;
+
+        block.add(key, value);
+
+        if (block.estimatedSize() >= blockSize) flushBlock();
+    }
+
+    // Writes the index, filters and footer and fsyncs the file. Returns false, with the
+    // table incomplete, if any write or the sync failed.
+    bool finish(SSTableMetadata& meta) {
+        flushBlock();
+
+        std::vector<IndexPartition> partitions;
+        BlockBuilder indexBlock;
+        Buffer handle;
+        size_t partitionStart = 0;
+        for (size_t i = 0; i < index.size(); i++) {
+            handle.clear();
+            encodeVarint64(handle, index[i].offset);
+            encodeVarint32(handle, index[i].size);
+            indexBlock.add(index[i].key, asView(handle));
+            if (indexBlock.estimatedSize() >= indexPartitionSize || i + 1 == index.size()) {
+                partitions.push_back(writePartition(indexBlock, partitionStart, i + 1));
+                partitionStart = i + 1;
+            }
+        }
+
+        // Top-level index entries: [KeyLen][Key][Offset][Size][FilterOffset][FilterSize], all
+        // varints. It and the prefix filter get the same trailer as blocks.
+        uint64_t indexStartOffset = currentOffset;
+        Buffer indexBuf;
+        for (const auto& partition : partitions) {
+            encodeVarint32(indexBuf, partition.key.size());
+            encodeBytes(indexBuf, partition.key);
+            encodeVarint64(indexBuf, partition.offset);
+            encodeVarint32(indexBuf, partition.size);
+            encodeVarint64(indexBuf, partition.filterOffset);
+            encodeVarint32(indexBuf, partition.filterSize);
+        }
+        writeBlock(indexBuf, CompressionType::None);
+
+        uint64_t bloomStartOffset = currentOffset;
+        Buffer bloomBuf;
+        encodeLength(bloomBuf, prefixLength);
+        BloomFilter prefixBf;
+        if (prefixLength > 0) {
+            prefixBf = BloomFilter(prefixHashes.size(), bloomBitsPerKey);
+            for (uint64_t hash : prefixHashes) prefixBf.addHash(hash);
+            prefixBf.serialize(bloomBuf);
+        }
+        writeBlock(bloomBuf, CompressionType::None);
+
+        Buffer footer;
+        encodeFooter(footer, indexStartOffset, bloomStartOffset);
+        append(footer);
+        if (!failed && ::fsync(fd) != 0) failed = true;
+        ::close(fd);
+        fd = -1;
+        if (failed) return false;
+
+        meta.filename = filename;
+        meta.fileId = newTableId();
+        meta.formatVersion = SSTABLE_FORMAT_CURRENT;
+        meta.indexPartitions = std::move(partitions);
+        meta.prefixFilter = std::move(prefixBf);
+        meta.prefixLength = prefixLength;
+        meta.smallestKey = firstKey;
+        meta.largestKey = lastKey;
+        meta.fileSize = currentOffset;
+        return true;
+    }
+};
+
+// --- Iterators ---
+
+// Cursor over sorted key/value pairs, movable both ways. key() and value() are only
+// good until the iterator moves. ok() turns false if a block could not be read, after
+// which the iterator reports !valid().
+class Iterator {
+public:
+    virtual ~Iterator() = default;
+    virtual bool valid() const = 0;
+    virtual void seekToFirst() = 0;
+    virtual void seekToLast() = 0;
+    // Positions at the first entry whose key is >= target.
+    virtual void seek(std::string_view target) = 0;
+    virtual void next() = 0;
+    virtual void prev() = 0;
+    virtual std::string_view key() const = 0;
+    virtual std::string_view value() const = 0;
+    virtual bool ok() const { return true; }
+};
+
+// Walks a table's block index, one IndexEntry per data block. In v1 tables that is the
+// resident SSTableMetadata::sparseIndex; in v2 tables the partition under the cursor is
+// loaded when the cursor moves onto it, and only it is held.
+class IndexIterator {
+public:
+    using BlockLoader = std::function<BlockContents(const IndexEntry&)>;
+
+private:
+    const SSTableMetadata* meta;
+    BlockLoader loadPartition;
+    bool partitioned;
+    size_t pos = 0; // position in sparseIndex, or the partition number
+    BlockContents block;
+    std::unique_ptr<BlockIterator> blockIt;
+    IndexEntry current;
+    bool isValid = false;
+    bool status = true;
+
+    void openPartition(size_t i) {
+        pos = i;
+        blockIt.reset();
+        block = {};
+        if (i >= meta->indexPartitions.size()) return;
+        const IndexPartition& partition = meta->indexPartitions[i];
+        block = loadPartition({std::string(), partition.offset, partition.size});
+        if (!block) {
+            status = false;
+            return;
+        }
+        blockIt = std::make_unique<BlockIterator>(block.data, meta->formatVersion);
+    }
+
+    // Decodes the block handle under blockIt into current.
+    void decode() {
+        isValid = false;
+        if (!blockIt || !blockIt->valid()) return;
+        std::string_view handle = blockIt->value();
+        size_t offset = 0;
+        try {
+            current.offset = decodeVarint64(handle, offset);
+            current.size = decodeVarint32(handle, offset);
+        } catch (...) {
+            status = false;
+            blockIt.reset();
+            return;
+        }
+        current.key.assign(blockIt->key());
+        isValid = true;
+    }
+
+    void skipExhaustedPartitions() {
+        while (blockIt && !blockIt->valid()) {
+            openPartition(pos + 1);
+            if (blockIt) blockIt->seekToFirst();
+        }
+        decode();
+    }
+
+    void skipExhaustedPartitionsBackward() {
+        while (blockIt && !blockIt->valid()) {
+            if (pos == 0) {
+                openPartition(meta->indexPartitions.size());
+                break;
+            }
+            openPartition(pos - 1);
+            if (blockIt) blockIt->seekToLast();
+        }
+        decode();
+    }
+
+public:
+    IndexIterator(const SSTableMetadata* table, BlockLoader loader)
+        : meta(table), loadPartition(std::move(loader)), partitioned(!table->indexPartitions.empty()) {}
+
+    bool valid() const { return partitioned ? isValid : pos < meta->sparseIndex.size(); }
+    const IndexEntry& entry() const { return partitioned ? current : meta->sparseIndex[pos]; }
+    bool ok() const { return status; }
+
+    void seekToFirst() {
+        if (!partitioned) {
+            pos = 0;
+            return;
+        }
+        openPartition(0);
+        if (blockIt) blockIt->seekToFirst();
+        skipExhaustedPartitions();
+    }
+
+    void seekToLast() {
+        if (!partitioned) {
+            pos = meta->sparseIndex.empty() ? 0 : meta->sparseIndex.size() - 1;
+            return;
+        }
+        openPartition(meta->indexPartitions.size() - 1);
+        if (blockIt) blockIt->seekToLast();
+        skipExhaustedPartitionsBackward();
+    }
+
+    // Positions at the last block whose first key is <= target, or the first block.
+    void seek(std::string_view target) {
+        if (!partitioned) {
+            const auto& index = meta->sparseIndex;
+            auto it = std::upper_bound(index.begin(), index.end(), target,
+                [](std::string_view val, const IndexEntry& entry) {
+                    return val < entry.key;
+                });
+            pos = it == index.begin() ? 0 : (it - index.begin()) - 1;
+            return;
+        }
+        const auto& partitions = meta->indexPartitions;
+        auto it = std::upper_bound(partitions.begin(), partitions.end(), target,
+            [](std::string_view val, const IndexPartition& partition) {
+                return val < partition.key;
+            });
+        openPartition(it == partitions.begin() ? 0 : (it - partitions.begin()) - 1);
+        if (blockIt) {
+            blockIt->seek(target);
+            if (!blockIt->valid()) {
+                blockIt->seekToLast();
+            } else if (blockIt->key() > target) {
+                blockIt->prev();
+                if (!blockIt->valid()) blockIt->seekToFirst();
+            }
+        }
+        skipExhaustedPartitions();
+    }
+
+    void next() {
+        if (!partitioned) {
+            pos++;
+            return;
+        }
+        blockIt->next();
+        skipExhaustedPartitions();
+    }
+
+    void prev() {
+        if (!partitioned) {
+            pos = pos == 0 ? meta->sparseIndex.size() : pos - 1;
+            return;
+        }
+        blockIt->prev();
+        skipExhaustedPartitionsBackward();
+    }
+};
+
+// Walks a table in key order, holding one block at a time. loadIndex fetches v2 index
+// partitions, loader the data blocks.
+class TableIterator : public Iterator {
+public:
+    using BlockLoader = IndexIterator::BlockLoader;
+
+private:
+    std::shared_ptr<const SSTableMetadata> meta;
+    BlockLoader loadBlock;
+    IndexIterator index;
+    BlockContents block;
+    std::unique_ptr<BlockIterator> blockIt;
+    bool status = true;
+
+    void openBlock() {
+        blockIt.reset();
+        block = {};
+        if (!index.valid()) return;
+        block = loadBlock(index.entry());
+        if (!block) {
+            status = false;
+            return;
+        }
+        blockIt = std::make_unique<BlockIterator>(block.data, meta->formatVersion);
+    }
+
+    void skipExhaustedBlocks() {
+        while (blockIt && !blockIt->valid()) {
+            index.next();
+            openBlock();
+            if (blockIt) blockIt->seekToFirst();
+        }
+    }
+
+    void skipExhaustedBlocksBackward() {
+        while (blockIt && !blockIt->valid()) {
+            index.prev();
+            openBlock();
+            if (blockIt) blockIt->seekToLast();
+        }
+    }
+
+public:
+    TableIterator(std::shared_ptr<const SSTableMetadata> table, BlockLoader loader, BlockLoader loadIndex)
+        : meta(std::move(table)), loadBlock(std::move(loader)), index(meta.get(), std::move(loadIndex)) {}
+
+    bool valid() const override { return blockIt && blockIt->valid(); }
+    std::string_view key() const override { return blockIt->key(); }
+    std::string_view value() const override { return blockIt->value(); }
+    bool ok() const override { return status && index.ok(); }
+
+    void seekToFirst() override {
+        index.seekToFirst();
+        openBlock();
+        if (blockIt) blockIt->seekToFirst();
+        skipExhaustedBlocks();
+    }
+
+    void seekToLast() override {
+        index.seekToLast();
+        openBlock();
+        if (blockIt) blockIt->seekToLast();
+        skipExhaustedBlocksBackward();
+    }
+
+    void seek(std::string_view target) override {
+        index.seek(target);
+        openBlock();
+        if (blockIt) blockIt->seek(target);
+        skipExhaustedBlocks();
+    }
+
+    void next() override {
+        blockIt->next();
+        skipExhaustedBlocks();
+    }
+
+    void prev() override {
+        blockIt->prev();
+        skipExhaustedBlocksBackward();
+    }
+};
+
+// Concatenates the tables of one level (L1 and down), whose key ranges are disjoint
+// and sorted, opening one table iterator at a time.
+class LevelIterator : public Iterator {
+public:
+    using TableOpener = std::function<std::unique_ptr<Iterator>(const std::shared_ptr<SSTableMetadata>&)>;
+
+private:
+    std::vector<std::shared_ptr<SSTableMetadata>> files;
+    TableOpener openTable;
+    size_t fileIndex = 0;
+    std::unique_ptr<Iterator> current;
+    bool status = true;
+
+    void openFile(size_t i) {
+        if (current && !current->ok()) status = false;
+        fileIndex = i;
+        current.reset();
+        if (i < files.size()) current = openTable(files[i]);
+    }
+
+    void skipExhaustedFiles() {
+        while (current && !current->valid()) {
+            openFile(fileIndex + 1);
+            if (current) current->seekToFirst();
+        }
+    }
+
+    void skipExhaustedFilesBackward() {
+        while (current && !current->valid()) {
+            if (fileIndex == 0) {
+                openFile(files.size());
+                return;
+            }
+            openFile(fileIndex - 1);
+            if (current) current->seekToLast();
+        }
+    }
+
+public:
+    LevelIterator(std::vector<std::shared_ptr<SSTableMetadata>> levelFiles, TableOpener opener)
+        : files(std::move(levelFiles)), openTable(std::move(opener)) {}
+
+    bool valid() const override { return current && current->valid(); }
+    std::string_view key() const override { return current->key(); }
+    std::string_view value() const override { return current->value(); }
+    bool ok() const override { return status && (!current || current->ok()); }
+
+    void seekToFirst() override {
+        openFile(0);
+        if (current) current->seekToFirst();
+        skipExhaustedFiles();
+    }
+
+    void seekToLast() override {
+        openFile(files.empty() ? 0 : files.size() - 1);
+        if (current) current->seekToLast();
+        skipExhaustedFilesBackward();
+    }
+
+    void seek(std::string_view target) override {
+        auto it = std::lower_bound(files.begin(), files.end(), target,
+            [](const std::shared_ptr<SSTableMetadata>& meta, std::string_view k) {
+                return meta->largestKey < k;
+            });
+        openFile(it - files.begin());
+        if (current) current->seek(target);
+        skipExhaustedFiles();
+    }
+
+    void next() override {
+        current->next();
+        skipExhaustedFiles();
+    }
+
+    void prev() override {
+        current->prev();
+        skipExhaustedFilesBackward();
+    }
+};
+
+// Merges sorted children into one stream with a heap: smallest key on top going
+// forward, largest going backward. children[0] is the newest source: when several hold
+// the same key only the newest entry is returned.
+class MergingIterator : public Iterator {
+private:
+    std::vector<std::unique_ptr<Iterator>> children;
+    std::vector<size_t> heap;
+    std::string skipKey;
+    bool forward = true;
+
+    // Heap order: the key next in the current direction first, then the newer child.
+    bool after(size_t a, size_t b) const {
+        int c = children[a]->key().compare(children[b]->key());
+        if (c == 0) return a > b;
+        return forward ? c > 0 : c < 0;
+    }
+
+    void rebuildHeap() {
+        heap.clear();
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i]->valid()) heap.push_back(i);
+        }
+        std::make_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return after(a, b); });
+    }
+
+    void advanceTop() {
+        auto cmp = [this](size_t a, size_t b) { return after(a, b); };
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        size_t i = heap.back();
+        heap.pop_back();
+        if (forward) {
+            children[i]->next();
+        } else {
+            children[i]->prev();
+        }
+        if (children[i]->valid()) {
+            heap.push_back(i);
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        }
+    }
+
+    // Steps past the current key, including the other entries for it.
+    void skipCurrentKey() {
+        skipKey.assign(key());
+        do {
+            advanceTop();
+        } while (!heap.empty() && key() == skipKey);
+    }
+
+public:
+    explicit MergingIterator(std::vector<std::unique_ptr<Iterator>> sources) : children(std::move(sources)) {}
+
+    bool valid() const override { return !heap.empty(); }
+    std::string_view key() const override { return children[heap.front()]->key(); }
+    std::string_view value() const override { return children[heap.front()]->value(); }
+
+    bool ok() const override {
+        for (const auto& child : children) {
+            if (!child->ok()) return false;
+        }
+        return true;
+    }
+
+    void seekToFirst() override {
+        forward = true;
+        for (auto& child : children) child->seekToFirst();
+        rebuildHeap();
+    }
+
+    void seekToLast() override {
+        forward = false;
+        for (auto& child : children) child->seekToLast();
+        rebuildHeap();
+    }
+
+    void seek(std::string_view target) override {
+        forward = true;
+        for (auto& child : children) child->seek(target);
+        rebuildHeap();
+    }
+
+    void next() override {
+        if (forward) {
+            skipCurrentKey();
+            return;
+        }
+        // Coming from prev(), the other children sit before the current key: move every
+        // child to its first entry after it.
+        skipKey.assign(key());
+        for (auto& child : children) {
+            child->seek(skipKey);
+            while (child->valid() && child->key() == skipKey) child->next();
+        }
+        forward = true;
+        rebuildHeap();
+    }
+
+    void prev() override {
+        if (!forward) {
+            skipCurrentKey();
+            return;
+        }
+        skipKey.assign(key());
+        for (auto& child : children) {
+            child->seek(skipKey);
+            if (child->valid()) {
+                child->prev();
+            } else {
+                child->seekToLast();
+            }
+        }
+        forward = false;
+        rebuildHeap();
+    }
+};
+
+// --- Arena ---
+// Bump allocator behind a memtable. Nothing is freed individually; all memory goes back
+// at once when the arena is destroyed. allocate() may be called from several threads:
+// they claim space in the current block with one fetch_add, and only take the mutex to
+// start a new block.
+
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+class Arena {
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+        std::atomic<size_t> used{0}; // may run past size; claims past it are abandoned
+        explicit Block(size_t bytes) : data(new char[bytes]), size(bytes) {}
+    };
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::atomic<Block*> current{nullptr};
+    std::atomic<size_t> usage{0};
+
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Returned memory is pointer-aligned.
+    char* allocate(size_t bytes) {
+        const size_t align = alignof(void*);
+        bytes = (bytes + align - 1) & ~(align - 1);
+        usage.fetch_add(bytes, std::memory_order_relaxed);
+
+        // A large request gets a block of its own so the current block's tail is not
+        // thrown away.
+        if (bytes > ARENA_BLOCK_SIZE / 4) {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocks.push_back(std::make_unique<Block>(bytes));
+            return blocks.back()->data.get();
+        }
+
+        while (true) {
+            Block* block = current.load(std::memory_order_acquire);
+            if (block != nullptr) {
+                size_t offset = block->used.fetch_add(bytes, std::memory_order_relaxed);
+                if (offset <= block->size - bytes) return block->data.get() + offset;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            // Another thread may have started a new block while this one waited.
+            if (current.load(std::memory_order_relaxed) == block) {
+                blocks.push_back(std::make_unique<Block>(ARENA_BLOCK_SIZE));
+                current.store(blocks.back().get(), std::memory_order_release);
+            }
+        }
+    }
+
+    // Bytes handed out so far, so a memtable fills up by what its entries take rather
+    // than by whole blocks.
+    size_t memoryUsage() const { return usage.load(std::memory_order_relaxed); }
+};
+
+// One arena allocation: this header, nodeLevel + 1 atomic links and then the key bytes.
+// Links are atomic so readers can walk the list while writers splice nodes in. The
+// value lives in its own arena allocation as [fixed32 length][bytes] and is replaced
+// by swapping the pointer.
+struct Node {
+    std::atomic<const char*> encodedValue;
+    uint32_t keySize;
+    int nodeLevel;
+    std::atomic<Node*> forward[1];
+
+    std::string_view key() const {
+        return std::string_view(reinterpret_cast<const char*>(forward + nodeLevel + 1), keySize);
+    }
+
+    std::string_view value() const {
+        const char* p = encodedValue.load(std::memory_order_acquire);
+        return std::string_view(p + 4, getFixed32(reinterpret_cast<const uint8_t*>(p)));
+    }
+
+    Node* next(int level) const { return forward[level].load(std::memory_order_acquire); }
+};
+
+// --- MemTable ---
+// Concurrent skip list keyed by internal key, so every version of a user key has a node
+// of its own, newest first; inserting a key that is already there replaces its value.
+// Inserts splice nodes in with CAS, so any number of threads may insert at once;
+// lookups and scans take no locks and never wait. Nodes, keys and values all live in the arena: nothing is unlinked or
+// freed before the memtable itself goes, so a reader is never left with a dangling
+// node or value, and dropping a flushed memtable is a handful of block frees.
+
+class MemTable {
+private:
+    Arena arena;
+    Node* head;
+    std::atomic<int> maxHeight{0};
+    std::atomic<size_t> numEntries{0};
+
+    // Per-thread generator: rand() serializes on a global lock and is not thread-safe.
+    static int randomLevel() {
+        thread_local std::minstd_rand rng(std::random_device{}());
+        int lvl = 0;
+        while (lvl < MAX_LEVEL && rng() % 4 == 0) {
+            lvl++;
+        }
+        return lvl;
+    }
+
+    Node* newNode(std::string_view key, const char* encodedValue, int height) {
+        size_t size = sizeof(Node) + sizeof(std::atomic<Node*>) * height + key.size();
+        char* mem = arena.allocate(size);
+        Node* n = new (mem) Node;
+        n->encodedValue.store(encodedValue, std::memory_order_relaxed);
+        n->keySize = static_cast<uint32_t>(key.size());
+        n->nodeLevel = height;
+        for (int i = 0; i <= height; i++) new (&n->forward[i]) std::atomic<Node*>(nullptr);
+        memcpy(mem + sizeof(Node) + sizeof(std::atomic<Node*>) * height, key.data(), key.size());
+        return n;
+    }
+
+    const char* encodeValue(std::string_view value) {
+        char* p = arena.allocate(4 + value.size());
+        putFixed32(reinterpret_cast<uint8_t*>(p), static_cast<uint32_t>(value.size()));
+        if (!value.empty()) memcpy(p + 4, value.data(), value.size());
+        return p;
+    }
+
+    // Fills preds/succs with the nodes around key's position on every level.
+    void findSplice(std::string_view key, Node** preds, Node** succs) const {
+        Node* current = head;
+        for (int i = MAX_LEVEL; i >= 0; i--) {
+            Node* next = current->next(i);
+            while (next != nullptr && next->key() < key) {
+                current = next;
+                next = current->next(i);
+            }
+            preds[i] = current;
+            succs[i] = next;
+        }
+    }
+
+    // Redoes one level of the splice after a lost CAS. Nodes are never removed, so the
+    // old predecessor is still a valid place to start.
+    static void findSpliceForLevel(std::string_view key, int level, Node*& pred, Node*& succ) {
+        Node* next = pred->next(level);
+        while (next != nullptr && next->key() < key) {
+            pred = next;
+            next = pred->next(level);
+        }
+        succ = next;
+    }
+
+public:
+    MemTable() { head = newNode("", nullptr, MAX_LEVEL); }
+    MemTable(const MemTable&) = delete;
+    MemTable& operator=(const MemTable&) = delete;
+
+    void insert(std::string_view key, std::string_view value) {
+        const char* encodedValue = encodeValue(value);
+
+        Node* preds[MAX_LEVEL + 1];
+        Node* succs[MAX_LEVEL + 1];
+        findSplice(key, preds, succs);
+        if (succs[0] != nullptr && succs[0]->key() == key) {
+            succs[0]->encodedValue.store(encodedValue, std::memory_order_release);
+            return;
+        }
+
+        int height = randomLevel();
+        int currentMax = maxHeight.load(std::memory_order_relaxed);
+        while (height > currentMax && !maxHeight.compare_exchange_weak(currentMax, height, std::memory_order_relaxed)) {
+        }
+
+        // Link bottom-up: once level 0 is in, the node is visible and every higher
+        // level is only a shortcut to it.
+        Node* n = newNode(key, encodedValue, height);
+        for (int i = 0; i <= height; i++) {
+            while (true) {
+                n->forward[i].store(succs[i], std::memory_order_relaxed);
+                Node* expected = succs[i];
+                if (preds[i]->forward[i].compare_exchange_strong(expected, n, std::memory_order_release,
+                                                                 std::memory_order_relaxed)) {
+                    break;
+                }
+                findSpliceForLevel(key, i, preds[i], succs[i]);
+                if (i == 0 && succs[0] != nullptr && succs[0]->key() == key) {
+                    // Another writer inserted the same key first. Ours was never linked
+                    // and simply stays unused in the arena.
+                    succs[0]->encodedValue.store(encodedValue, std::memory_order_release);
+                    return;
+                }
+            }
+        }
+        numEntries.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // First node whose key is >= key, or nullptr. Nodes stay valid for the life of the
+    // memtable.
+    const Node* seek(std::string_view key) const {
+        Node* current = head;
+        for (int i = maxHeight.load(std::memory_order_relaxed); i >= 0; i--) {
+            Node* next = current->next(i);
+            while (next != nullptr && next->key() < key) {
+                current = next;
+                next = current->next(i);
+            }
+        }
+        return current->next(0);
+    }
+
+    // Last node whose key is < key, or nullptr.
+    const Node* seekBefore(std::string_view key) const {
+        Node* current = head;
+        for (int i = maxHeight.load(std::memory_order_relaxed); i >= 0; i--) {
+            Node* next = current->next(i);
+            while (next != nullptr && next->key() < key) {
+                current = next;
+                next = current->next(i);
+            }
+        }
+        return current == head ? nullptr : current;
+    }
+
+    const Node* last() const {
+        Node* current = head;
+        for (int i = maxHeight.load(std::memory_order_relaxed); i >= 0; i--) {
+            Node* next = current->next(i);
+            while (next != nullptr) {
+                current = next;
+                next = current->next(i);
+            }
+        }
+        return current == head ? nullptr : current;
+    }
+
+    const Node* first() const { return head->next(0); }
+    size_t approximateMemoryUsage() const { return arena.memoryUsage(); }
+    size_t size() const { return numEntries.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+};
+
+// Walks a memtable while writers keep inserting; new nodes may or may not be seen.
+// The memtable must outlive the iterator. prev() is a search from the top, as nodes
+// only link forward.
+class MemTableIterator : public Iterator {
+private:
+    const MemTable* table;
+    const Node* node = nullptr;
+
+public:
+    explicit MemTableIterator(const MemTable* memTable) : table(memTable) {}
+
+    bool valid() const override { return node != nullptr; }
+    std::string_view key() const override { return node->key(); }
+    std::string_view value() const override { return node->value(); }
+
+    void seekToFirst() override { node = table->first(); }
+    void seekToLast() override { node = table->last(); }
+    void seek(std::string_view target) override { node = table->seek(target); }
+    void next() override { node = node->next(0); }
+    void prev() override { node = table->seekBefore(node->key()); }
+};
+
+// name + zero-padded number + suffix, e.g. ("wal_", 7, ".log") -> "wal_000007.log".
+inline std::string numberedFileName(const std::string& prefix, uint64_t number, const std::string& suffix) {
+    std::string digits = std::to_string(number);
+    if (digits.size() < 6) digits.insert(0, 6 - digits.size(), '0');
+    return prefix + digits + suffix;
+}
+
+// --- Versions ---
+
+// One state of the table set. A Version is never changed once it is installed: flush
+// and compaction copy the current one, edit the copy and install that, so a reader
+// holding an older Version keeps a consistent view, and the files in it, for as long
+// as it needs them.
+struct Version {
+    // levels[0] is ordered oldest to newest; deeper levels are sorted by smallest key.
+    std::vector<std::shared_ptr<SSTableMetadata>> levels[NUM_LEVELS];
+
+    // A table's level is where a version holds it, not a property of the table: a
+    // trivial move puts the same metadata at another level in the next version while
+    // older versions still list it at the old one.
+    void addFile(int level, std::shared_ptr<SSTableMetadata> meta) {
+        auto& files = levels[level];
+        if (level == 0) {
+            files.push_back(std::move(meta));
+            return;
+        }
+        auto pos = std::upper_bound(files.begin(), files.end(), meta,
+            [](const std::shared_ptr<SSTableMetadata>& a, const std::shared_ptr<SSTableMetadata>& b) {
+                return a->smallestKey < b->smallestKey;
+            });
+        files.insert(pos, std::move(meta));
+    }
+
+    void removeFiles(int level, const std::vector<std::shared_ptr<SSTableMetadata>>& files) {
+        auto& current = levels[level];
+        current.erase(std::remove_if(current.begin(), current.end(), [&](const std::shared_ptr<SSTableMetadata>& meta) {
+            return std::find(files.begin(), files.end(), meta) != files.end();
+        }), current.end());
+    }
+
+    std::vector<std::shared_ptr<SSTableMetadata>> overlappingFiles(int level, std::string_view smallest,
+                                                                   std::string_view largest) const {
+        std::vector<std::shared_ptr<SSTableMetadata>> result;
+        for (const auto& meta : levels[level]) {
+            if (meta->overlaps(smallest, largest)) result.push_back(meta);
+        }
+        return result;
+    }
+
+    size_t fileCount() const {
+        size_t count = 0;
+        for (const auto& files : levels) count += files.size();
+        return count;
+    }
+};
+
+// Everything a read looks at, published as one pointer so a reader only copies that
+// pointer, under a mutex of its own, instead of holding the store's mutex.
+struct SuperVersion {
+    std::shared_ptr<MemTable> mem;
+    std::shared_ptr<MemTable> imm;
+    std::shared_ptr<const Version> version;
+};
+
+// --- DB Iterator ---
+// The user-facing scan: turns the merged stream of internal entries into one entry per
+// user key, the newest version at or below the read's sequence number, with deleted
+// keys left out. key() is the user key. It holds the SuperVersion it was built from,
+// so the memtables and tables it reads stay around for as long as it does. Keys
+// outside [lower, upper) (encoded user keys, empty for no bound) are never returned.
+
+class DBIterator : public Iterator {
+private:
+    std::shared_ptr<const SuperVersion> sv;
+    MergingIterator iter;
+    uint64_t sequence;
+    bool forward = true;
+    bool isValid = false;
+    // Encoded user key of the current entry. Going backward iter is already past the
+    // current entry, so its value is copied into savedValue.
+    std::string savedUserKey;
+    std::string savedValue;
+    std::string userKey;
+    std::string lower;
+    std::string upper;
+
+    void seekToLowerBound() {
+        if (lower.empty()) {
+            iter.seekToFirst();
+            return;
+        }
+        std::string first = lower;
+        appendKeyTrailer(first, MAX_SEQUENCE, ValueType::Value);
+        iter.seek(first);
+    }
+
+    // Moves iter to the newest visible version of the next user key that is not
+    // deleted. With skip set, the remaining entries of savedUserKey are passed first.
+    void findNextUserEntry(bool skip) {
+        for (; iter.valid(); iter.next()) {
+            std::string_view key = iter.key();
+            if (!upper.empty() && encodedUserKey(key) >= upper) break;
+            if (keySequence(key) > sequence) continue;
+            if (skip && encodedUserKey(key) == savedUserKey) continue;
+            savedUserKey.assign(encodedUserKey(key));
+            if (keyType(key) == ValueType::Deletion) {
+                skip = true;
+                continue;
+            }
+            userKey = decodeUserKey(savedUserKey);
+            isValid = true;
+            return;
+        }
+        isValid = false;
+    }
+
+    // Walking backward a user key's versions come oldest first, so this keeps the last
+    // visible one seen and stops on reaching a smaller user key with a live one saved.
+    void findPrevUserEntry() {
+        ValueType type = ValueType::Deletion;
+        for (; iter.valid(); iter.prev()) {
+            std::string_view key = iter.key();
+            if (!lower.empty() && encodedUserKey(key) < lower) break;
+            if (keySequence(key) > sequence) continue;
+            if (type != ValueType::Deletion && encodedUserKey(key) < savedUserKey) break;
+            type = keyType(key);
+            if (type == ValueType::Deletion) {
+                savedUserKey.clear();
+                savedValue.clear();
+            } else {
+                savedUserKey.assign(encodedUserKey(key));
+                savedValue.assign(iter.value());
+            }
+        }
+        if (type == ValueType::Deletion) {
+            isValid = false;
+            forward = true;
+            savedUserKey.clear();
+            savedValue.clear();
+            return;
+        }
+        userKey = decodeUserKey(savedUserKey);
+        isValid = true;
+    }
+
+public:
+    DBIterator(std::shared_ptr<const SuperVersion> superVersion, std::vector<std::unique_ptr<Iterator>> children,
+               uint64_t readSequence, std::string lowerBound = "", std::string upperBound = "")
+        : sv(std::move(superVersion)), iter(std::move(children)), sequence(readSequence),
+          lower(std::move(lowerBound)), upper(std::move(upperBound)) {}
+
+    bool valid() const override { return isValid; }
+    std::string_view key() const override { return userKey; }
+    std::string_view value() const override { return forward ? iter.value() : std::string_view(savedValue); }
+    bool ok() const override { return iter.ok(); }
+
+    void seekToFirst() override {
+        forward = true;
+        seekToLowerBound();
+        findNextUserEntry(false);
+    }
+
+    void seekToLast() override {
+        forward = false;
+        if (upper.empty()) {
+            iter.seekToLast();
+        } else {
+            std::string first = upper;
+            appendKeyTrailer(first, MAX_SEQUENCE, ValueType::Value);
+            iter.seek(first);
+            if (iter.valid()) {
+                iter.prev();
+            } else {
+                iter.seekToLast();
+            }
+        }
+        findPrevUserEntry();
+    }
+
+    void seek(std::string_view target) override {
+        forward = true;
+        std::string key = internalKey(target, sequence, ValueType::Value);
+        if (!lower.empty() && encodedUserKey(key) < lower) {
+            seekToLowerBound();
+        } else {
+            iter.seek(key);
+        }
+        findNextUserEntry(false);
+    }
+
+    void next() override {
+        if (!forward) {
+            // iter sits just before the current key's entries; step into them so the
+            // skip below passes over them.
+            forward = true;
+            if (iter.valid()) {
+                iter.next();
+            } else {
+                seekToLowerBound();
+            }
+        }
+        findNextUserEntry(true);
+    }
+
+    void prev() override {
+        if (forward) {
+            // iter is on the current entry; back out of all of its user key's entries.
+            do {
+                iter.prev();
+            } while (iter.valid() && encodedUserKey(iter.key()) >= savedUserKey);
+            if (!iter.valid()) {
+                isValid = false;
+                savedUserKey.clear();
+                return;
+            }
+            forward = false;
+        }
+        findPrevUserEntry();
+    }
+};
+
+// --- Main KVStore Class ---
+
+class KVStore {
+private:
+    // Writes go to mem. When it fills up it becomes imm, which stays readable until the
+    // background thread has written it to L0. Each memtable logs to its own WAL segment
+    // (wal_NNNNNN.log), deleted once that memtable is on disk.
+    std::shared_ptr<MemTable> mem;
+    std::shared_ptr<MemTable> imm;
+    uint64_t logNumber = 0;
+    uint64_t immLogNumber = 0;
+    uint64_t nextLogNumber = 1;
+    WALWriter wal;
+    const std::string legacyWalFileName = "wal.log";
+    const std::string manifestFileName = "MANIFEST";
+    
+    // How deletes were stored before records had sequence numbers and a type: a put of
+    // this value. Only read when upgrading old tables and logs.
+    const std::string TOMBSTONE_VALUE = "~~DELETED~";
+
+    uint64_t nextFileNumber = 1;
+    // Sequence number of the last write applied to mem. Only the write leader advances
+    // it, after the whole group is in the memtable, so a read never sees half a batch.
+    std::atomic<uint64_t> lastSequence{0};
+    // Sequence numbers of the snapshots handed out and not yet released. Guarded by mutex.
+    std::multiset<uint64_t> snapshots;
+    std::shared_ptr<const Version> current = std::make_shared<Version>();
+    // mem, imm and current as readers see them. Replaced (under mutex) whenever one of
+    // them changes. Read and replaced under superVersionMutex, which is only ever held
+    // for the pointer copy, so readers never wait on the store's mutex.
+    std::shared_ptr<const SuperVersion> superVersion;
+    mutable std::mutex superVersionMutex;
+    // Where the next Ln -> Ln+1 compaction starts, so successive ones rotate through the keys.
+    std::string compactPointer[NUM_LEVELS];
+
+    // Guards mem/imm swaps, current, nextFileNumber and the manifest. bgCv signals both
+    // "imm is waiting to be flushed" and "imm has been flushed".
+    std::mutex mutex;
+    std::condition_variable bgCv;
+    std::thread flushThread;
+    bool shuttingDown = false;
+    // Set once a write can no longer be made durable (the WAL could not be opened, an
+    // append or sync failed, or a flush kept failing) or a compaction failed. From then
+    // on writes fail instead of being acknowledged, and no further flushes or compactions
+    // are scheduled. Guarded by mutex.
+    std::string backgroundError;
+
+    std::thread scrubThread;
+    std::atomic<uint64_t> checksumFailures{0};
+
+    // Compaction threads wait on compactionCv for work. A manual compact() first waits
+    // for the running ones to drain and holds the others off until it is done.
+    std::vector<std::thread> compactionThreads;
+    std::condition_variable compactionCv;
+    int runningCompactions = 0;
+    bool manualCompaction = false;
+    std::unique_ptr<RateLimiter> rateLimiter;
+
+    // Group commit: writers queue up; the one at the front becomes the leader, writes
+    // everyone's records with a single append (+ sync), applies them to the memtable in
+    // queue order, then wakes the rest. A flush() request queues as a writer with no
+    // batch so it never runs while a leader is inserting.
+    struct Writer {
+        const WriteBatch* batch;
+        bool done = false;
+        bool ok = true;
+        std::condition_variable cv;
+    };
+    std::mutex writeMutex;
+    std::deque<Writer*> writers;
+
+    Options options;
+    std::shared_ptr<BlockCache> blockCache;
+    std::shared_ptr<TableCache> tableCache;
+
+    // Cache-first fetch of an uncompressed block. Mapped, uncompressed blocks are handed
+    // out in place; compressed ones are decompressed once and that copy is what the cache
+    // keeps. Compaction passes fillCache = false so a full-table scan does not flush the
+    // hot working set out of the cache.
+    // v2 index partitions and filters are stored like data blocks and go through here too.
+    // With verify, a v2 block that fails its checksum comes back empty. Cached copies
+    // are decompressed and cannot be checked again; they are only known good when
+    // foreground reads verify too (ChecksumMode::Always), so otherwise a read that must
+    // verify goes to the file. This keeps compaction from copying a block that get()
+    // cached unchecked into a new table under a fresh checksum.
+    BlockContents readBlock(const SSTableMetadata& meta, uint64_t offset, uint32_t size, bool fillCache,
+                            bool verify) {
+        if (!verify || verifyReads()) {
+            BlockCache::Handle block = blockCache->lookup(meta.fileId, offset);
+            if (block) return {asView(*block), block};
+        }
+
+        auto file = tableCache->get(meta);
+        if (!file) return {};
+
+        size_t trailer = blockTrailerSize(meta.formatVersion);
+        size_t storedSize = size + trailer;
+
+        std::shared_ptr<Buffer> loaded;
+        std::string_view stored;
+        if (file->isMapped()) {
+            stored = file->view(offset, storedSize);
+            if (stored.size() != storedSize) return {};
+        } else {
+            loaded = std::make_shared<Buffer>(storedSize);
+            if (!file->read(offset, storedSize, loaded->data())) return {};
+            stored = asView(*loaded);
+        }
+
+        if (verify && meta.formatVersion != SSTABLE_FORMAT_V1 && !blockChecksumMatches(stored, size)) {
+            reportChecksumMismatch(meta, offset);
+            return {};
+        }
+
+        CompressionType type = trailer ? static_cast<CompressionType>(stored[size]) : CompressionType::None;
+        std::string_view payload = stored.substr(0, size);
+
+        if (type == CompressionType::None) {
+            if (file->isMapped()) return {payload, file};
+            loaded->resize(size);
+        } else {
+            auto uncompressed = std::make_shared<Buffer>();
+            if (!uncompressBlock(payload, type, *uncompressed)) return {};
+            loaded = uncompressed;
+        }
+
+        if (fillCache) blockCache->insert(meta.fileId, offset, loaded);
+        return {asView(*loaded), loaded};
+    }
+
+    BlockContents readDataBlock(const SSTableMetadata& meta, const IndexEntry& entry, bool fillCache, bool verify) {
+        return readBlock(meta, entry.offset, entry.size, fillCache, verify);
+    }
+
+    IndexIterator newIndexIterator(const SSTableMetadata& meta, bool fillCache, bool verify) {
+        return IndexIterator(&meta, [this, &meta, fillCache, verify](const IndexEntry& entry) {
+            return readDataBlock(meta, entry, fillCache, verify);
+        });
+    }
+
+    // What Options::checksumMode asks of foreground reads and of compaction.
+    bool verifyReads() const { return options.checksumMode == ChecksumMode::Always; }
+    bool verifyCompactionReads() const { return options.checksumMode != ChecksumMode::Never; }
+
+    void reportChecksumMismatch(const SSTableMetadata& meta, uint64_t offset) {
+        checksumFailures++;
+        std::cerr << "checksum mismatch in " << meta.filename << " at offset " << offset << std::endl;
+    }
+
+    // Reads every block of a v2 table straight from the file, the top-level index and
+    // prefix filter included, and checks its checksum. Returns how many failed, or did
+    // not read at all.
+    uint64_t scrubTable(const SSTableMetadata& meta) {
+        if (meta.formatVersion == SSTABLE_FORMAT_V1) return 0;
+        auto file = tableCache->get(meta);
+        if (!file) return 1;
+
+        Buffer stored;
+        uint64_t failures = 0;
+        auto check = [&](uint64_t offset, uint32_t size) {
+            stored.resize(size + blockTrailerSize(meta.formatVersion));
+            if (file->isMapped()) {
+                std::string_view view = file->view(offset, stored.size());
+                if (view.size() == stored.size() && blockChecksumMatches(view, size)) return;
+            } else if (file->read(offset, stored.size(), stored.data()) && blockChecksumMatches(asView(stored), size)) {
+                return;
+            }
+            reportChecksumMismatch(meta, offset);
+            failures++;
+        };
+        SSTableFooter footer;
+        size_t trailer = blockTrailerSize(meta.formatVersion);
+        if (!readFooter(*file, footer) || footer.bloomOffset - footer.indexOffset < trailer ||
+            file->size() - footer.size - footer.bloomOffset < trailer) {
+            reportChecksumMismatch(meta, file->size());
+            failures++;
+        } else {
+            check(footer.indexOffset, static_cast<uint32_t>(footer.bloomOffset - footer.indexOffset - trailer));
+            check(footer.bloomOffset, static_cast<uint32_t>(file->size() - footer.size - footer.bloomOffset - trailer));
+        }
+        for (const auto& partition : meta.indexPartitions) {
+            check(partition.offset, partition.size);
+            check(partition.filterOffset, partition.filterSize);
+        }
+        IndexIterator index = newIndexIterator(meta, false, true);
+        for (index.seekToFirst(); index.valid(); index.next()) check(index.entry().offset, index.entry().size);
+        return failures;
+    }
+
+    void scrubLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            bgCv.wait_for(lock, std::chrono::milliseconds(options.scrubIntervalMs), [&]() { return shuttingDown; });
+            if (shuttingDown) return;
+            lock.unlock();
+            scrub();
+            lock.lock();
+        }
+    }
+
+    // Whether the table's key filter lets lookup through. A v2 table is checked against
+    // the filter of the partition lookup falls in, unless the key's versions run on into
+    // the next partition, which is then where the search may end up. v1 tables have no
+    // filter loaded.
+    bool filterMayContain(const SSTableMetadata& meta, std::string_view lookup, uint64_t keyHash) {
+        std::string_view userKey = encodedUserKey(lookup);
+        if (meta.indexPartitions.empty()) return true;
+
+        const auto& partitions = meta.indexPartitions;
+        auto it = std::upper_bound(partitions.begin(), partitions.end(), lookup,
+            [](std::string_view val, const IndexPartition& partition) {
+                return val < partition.key;
+            });
+        if (it != partitions.end() && encodedUserKey(it->key) == userKey) return true;
+        if (it != partitions.begin()) it--;
+        if (!meta.pinnedFilters.empty()) {
+            return meta.pinnedFilters[it - partitions.begin()].possiblyContainsHash(keyHash);
+        }
+        BlockContents filter = readBlock(meta, it->filterOffset, it->filterSize, true, verifyReads());
+        return !filter || BloomFilter::probeSerialized(filter.data, keyHash);
+    }
+
+    // Per-iterator readahead state: where the next block would start if the scan keeps
+    // going in order, and how far the last hint reached.
+    struct Readahead {
+        uint64_t expectedOffset = UINT64_MAX;
+        uint64_t limit = 0;
+        size_t window = 0;
+    };
+
+    // Once two blocks are read back to back, hints the OS to fetch the next window of
+    // the file, doubling the window each time the scan runs past the last one. A jump
+    // (a seek) starts over.
+    void readaheadFor(const SSTableMetadata& meta, const IndexEntry& entry, Readahead& state) {
+        if (options.readaheadSize == 0) return;
+        bool sequential = entry.offset == state.expectedOffset;
+        state.expectedOffset = entry.offset + entry.size + blockTrailerSize(meta.formatVersion);
+        if (!sequential) {
+            state.window = 0;
+            state.limit = 0;
+            return;
+        }
+        if (state.expectedOffset < state.limit) return;
+
+        state.window = std::min(std::max<size_t>(state.window * 2, 16 * 1024), options.readaheadSize);
+        auto file = tableCache->get(meta);
+        if (file) file->readahead(state.expectedOffset, state.window);
+        state.limit = state.expectedOffset + state.window;
+    }
+
+    std::unique_ptr<Iterator> newTableIterator(const std::shared_ptr<SSTableMetadata>& meta, bool fillCache,
+                                               bool verify) {
+        auto readahead = std::make_shared<Readahead>();
+        return std::make_unique<TableIterator>(meta,
+            [this, meta, fillCache, verify, readahead](const IndexEntry& entry) {
+                readaheadFor(*meta, entry, *readahead);
+                return readDataBlock(*meta, entry, fillCache, verify);
+            },
+            [this, meta, fillCache, verify](const IndexEntry& entry) {
+                return readDataBlock(*meta, entry, fillCache, verify);
+            });
+    }
+
+    std::string walFileName(uint64_t number) const { return numberedFileName("wal_", number, ".log"); }
+
+    std::vector<uint64_t> listLogNumbers() const {
+        std::vector<uint64_t> numbers;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(".", ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.size() <= 8 || name.compare(0, 4, "wal_") != 0 || name.compare(name.size() - 4, 4, ".log") != 0) continue;
+            std::string digits = name.substr(4, name.size() - 8);
+            if (!std::all_of(digits.begin(), digits.end(), ::isdigit)) continue;
+            numbers.push_back(std::stoull(digits));
+        }
+        std::sort(numbers.begin(), numbers.end());
+        return numbers;
+    }
+
+    std::string tableFileName(int level, uint64_t number) const {
+        return numberedFileName("L" + std::to_string(level) + "_", number, ".sst");
+    }
+
+    std::shared_ptr<SSTableMetadata> writeLevel0Table(const MemTable& table, uint64_t fileNumber) {
+        SSTableBuilder builder(tableFileName(0, fileNumber), options, 0);
+        if (!builder.isOpen()) return nullptr;
+
+        for (const Node* current = table.first(); current != nullptr; current = current->next(0)) {
+            builder.add(current->key(), current->value());
+        }
+        SSTableMetadata built;
+        if (!builder.finish(built)) {
+            std::error_code ec;
+            std::filesystem::remove(tableFileName(0, fileNumber), ec);
+            return nullptr;
+        }
+        auto meta = adoptTable(std::move(built));
+        meta->fileNumber = fileNumber;
+        pinFilters(*meta);
+        return meta;
+    }
+
+    // Loads every partition filter of an L0 table into meta, before it is published.
+    void pinFilters(SSTableMetadata& meta) {
+        if (!options.pinL0Filters) return;
+        std::vector<BloomFilter> filters;
+        for (const auto& partition : meta.indexPartitions) {
+            BlockContents filter = readBlock(meta, partition.filterOffset, partition.filterSize, false, verifyReads());
+            if (!filter) return;
+            size_t offset = 0;
+            filters.push_back(BloomFilter::deserialize(filter.data, offset));
+        }
+        meta.pinnedFilters = std::move(filters);
+    }
+
+    // Hands out meta with a deleter that removes the file once the table is obsolete and
+    // the last version, reader or iterator holding it is gone.
+    std::shared_ptr<SSTableMetadata> adoptTable(SSTableMetadata meta) {
+        std::weak_ptr<TableCache> cache = tableCache;
+        return std::shared_ptr<SSTableMetadata>(new SSTableMetadata(std::move(meta)), [cache](SSTableMetadata* table) {
+            if (table->obsolete) {
+                if (auto tables = cache.lock()) tables->evict(table->fileId);
+                std::error_code ec;
+                std::filesystem::remove(table->filename, ec);
+            }
+            delete table;
+        });
+    }
+
+    // Publishes mem, imm and current to readers. Caller holds mutex.
+    void installSuperVersion() {
+        auto sv = std::make_shared<SuperVersion>();
+        sv->mem = mem;
+        sv->imm = imm;
+        sv->version = current;
+        // Swapped in, so the previous one and whatever only it kept alive are let go of
+        // outside the lock.
+        std::shared_ptr<const SuperVersion> old(std::move(sv));
+        std::lock_guard<std::mutex> lock(superVersionMutex);
+        superVersion.swap(old);
+    }
+
+    std::shared_ptr<const SuperVersion> acquireSuperVersion() const {
+        std::lock_guard<std::mutex> lock(superVersionMutex);
+        return superVersion;
+    }
+
+    // --- Leveled Compaction ---
+
+    // One Ln -> Ln+1 merge: inputs[0] from level, inputs[1] the files of level + 1 that
+    // overlap them.
+    struct Compaction {
+        int level = 0;
+        std::vector<std::shared_ptr<SSTableMetadata>> inputs[2];
+        bool dropTombstones = false;
+        // Versions newer than this may still be read through a snapshot and are kept.
+        uint64_t smallestSnapshot = 0;
+    };
+
+    uint64_t maxBytesForLevel(int level) const {
+        uint64_t bytes = options.level1MaxBytes;
+        for (int i = 1; i < level; i++) bytes *= options.levelSizeMultiplier;
+        return bytes;
+    }
+
+    static uint64_t totalFileSize(const std::vector<std::shared_ptr<SSTableMetadata>>& files) {
+        uint64_t total = 0;
+        for (const auto& meta : files) total += meta->fileSize;
+        return total;
+    }
+
+    // Fills in inputs[1], whether tombstones can go and the oldest snapshot to keep
+    // versions for. Caller holds mutex.
+    void setupOtherInputs(Compaction& c) {
+        c.smallestSnapshot = snapshots.empty() ? lastSequence.load() : *snapshots.begin();
+        std::string smallest, largest;
+        bool first = true;
+        auto widen = [&](const std::vector<std::shared_ptr<SSTableMetadata>>& files) {
+            for (const auto& meta : files) {
+                if (first || meta->smallestKey < smallest) smallest = meta->smallestKey;
+                if (first || meta->largestKey > largest) largest = meta->largestKey;
+                first = false;
+            }
+        };
+        widen(c.inputs[0]);
+        c.inputs[1] = current->overlappingFiles(c.level + 1, smallest, largest);
+
+        // A tombstone only has to survive while an older value may sit further down.
+        // The next-level inputs can reach past the upper inputs' range, so this checks
+        // the range of everything being merged.
+        widen(c.inputs[1]);
+        c.dropTombstones = true;
+        for (int level = c.level + 2; level < NUM_LEVELS; level++) {
+            if (!current->overlappingFiles(level, smallest, largest).empty()) c.dropTombstones = false;
+        }
+    }
+
+    // How far over its target a level is: L0 by file count, deeper levels by bytes. At 1
+    // or more the level is due for compaction. Caller holds mutex.
+    double levelScore(int level) const {
+        if (level == 0) {
+            return static_cast<double>(current->levels[0].size()) / std::max(1, options.level0CompactionTrigger);
+        }
+        return static_cast<double>(totalFileSize(current->levels[level])) / maxBytesForLevel(level);
+    }
+
+    static bool anyBeingCompacted(const std::vector<std::shared_ptr<SSTableMetadata>>& files) {
+        for (const auto& meta : files) {
+            if (meta->beingCompacted) return true;
+        }
+        return false;
+    }
+
+    // Picks work for a compaction thread, most overdue level first: L0 is scored by file
+    // count, deeper levels by bytes over target, and the last level is never a source.
+    // Levels whose candidates clash with a running compaction are passed over. The chosen
+    // files are marked beingCompacted. Nothing is picked after a background error: a
+    // failed compaction would only fail again on the same inputs. Caller holds mutex.
+    bool pickCompaction(Compaction& c) {
+        if (!backgroundError.empty()) return false;
+        std::vector<std::pair<double, int>> scores;
+        for (int level = 0; level < NUM_LEVELS - 1; level++) {
+            double score = levelScore(level);
+            if (score >= 1) scores.push_back({score, level});
+        }
+        std::sort(scores.rbegin(), scores.rend());
+
+        for (const auto& candidate : scores) {
+            int level = candidate.second;
+            c = Compaction();
+            c.level = level;
+            if (level == 0) {
+                // L0 files overlap, so they all go down together to keep newer data above older.
+                if (anyBeingCompacted(current->levels[0])) continue;
+                c.inputs[0] = current->levels[0];
+                setupOtherInputs(c);
+                if (anyBeingCompacted(c.inputs[1])) continue;
+            } else {
+                // Start after the last key compacted here and wrap around.
+                const auto& files = current->levels[level];
+                size_t start = 0;
+                while (start < files.size() && !compactPointer[level].empty() &&
+                       files[start]->largestKey <= compactPointer[level]) {
+                    start++;
+                }
+                bool found = false;
+                for (size_t n = 0; n < files.size() && !found; n++) {
+                    const auto& meta = files[(start + n) % files.size()];
+                    if (meta->beingCompacted) continue;
+                    c.inputs[0] = {meta};
+                    setupOtherInputs(c);
+                    found = !anyBeingCompacted(c.inputs[1]);
+                }
+                if (!found) continue;
+                compactPointer[level] = c.inputs[0][0]->largestKey;
+            }
+
+            for (const auto& files : c.inputs) {
+                for (const auto& meta : files) meta->beingCompacted = true;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Merges the inputs into level + 1, cutting output files at maxFileSize, then installs
+    // the outputs as one new version. A single file with nothing below it is moved down
+    // without being rewritten. The inputs are only marked obsolete here; their files go
+    // when the last reader still using an older version is done.
+    void runCompaction(const Compaction& c, bool allowTrivialMove) {
+        int outputLevel = c.level + 1;
+        if (allowTrivialMove && c.level > 0 && c.inputs[0].size() == 1 && c.inputs[1].empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto version = std::make_shared<Version>(*current);
+            version->removeFiles(c.level, c.inputs[0]);
+            version->addFile(outputLevel, c.inputs[0][0]);
+            if (!installVersion(version)) {
+                recordBackgroundError("compaction of level " + std::to_string(c.level) + " failed: manifest not written");
+            }
+            return;
+        }
 
-class BloomFilter {
-public:
-    std::vector<bool> bitArray;
-    int numHashes;
-    int sizeInBits;
+        std::vector<std::string> boundaries = subcompactionBoundaries(c);
+        std::vector<Subcompaction> subs(boundaries.size() + 1);
+        for (size_t i = 0; i < subs.size(); i++) {
+            subs[i].start = i > 0 ? &boundaries[i - 1] : nullptr;
+            subs[i].end = i < boundaries.size() ? &boundaries[i] : nullptr;
+        }
 
-    BloomFilter() : numHashes(0), sizeInBits(0) {}
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < subs.size(); i++) {
+            workers.emplace_back([this, &c, &subs, i]() { runSubcompaction(c, subs[i]); });
+        }
+        runSubcompaction(c, subs[0]);
+        for (auto& worker : workers) worker.join();
+
+        auto failed = std::find_if(subs.begin(), subs.end(), [](const Subcompaction& sub) { return !sub.ok; });
+        if (failed != subs.end()) {
+            std::error_code ec;
+            for (const auto& sub : subs) {
+                for (const auto& meta : sub.outputs) std::filesystem::remove(meta->filename, ec);
+            }
+            setBackgroundError("compaction of level " + std::to_string(c.level) + " failed: " + failed->error);
+            return;
+        }
 
-    BloomFilter(int n, double p = 0.01) {
-        double m = -(n * log(p)) / (pow(log(2), 2));
-        double k = (m / n) * log(2);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto version = std::make_shared<Version>(*current);
+        version->removeFiles(c.level, c.inputs[0]);
+        version->removeFiles(outputLevel, c.inputs[1]);
+        for (const auto& sub : subs) {
+            for (const auto& meta : sub.outputs) version->addFile(outputLevel, meta);
+        }
+        if (!installVersion(version)) {
+            recordBackgroundError("compaction of level " + std::to_string(c.level) + " failed: manifest not written");
+            for (const auto& sub : subs) {
+                for (const auto& meta : sub.outputs) meta->obsolete = true;
+            }
+            return;
+        }
+        for (const auto& files : c.inputs) {
+            for (const auto& meta : files) meta->obsolete = true;
+        }
+    }
 
-        sizeInBits = static_cast<int>(ceil(m));
-        numHashes = static_cast<int>(ceil(k));
-        bitArray.resize(sizeInBits, false);
+    // Records version in the manifest, then makes it current and publishes it to
+    // readers. If the manifest cannot be written nothing changes and this returns false.
+    // Caller holds mutex.
+    bool installVersion(std::shared_ptr<const Version> version) {
+        if (!writeManifest(*version)) return false;
+        current = std::move(version);
+        installSuperVersion();
+        return true;
     }
 
-    void add(const std::string& key) {
-        std::hash<std::string> hash1;
-        std::hash<std::string> hash2;
-        
-        size_t h1 = hash1(key);
-        size_t h2 = hash2(key + "_salt"); 
+    // One key range of a compaction: [*start, *end), where nullptr means unbounded.
+    struct Subcompaction {
+        const std::string* start = nullptr;
+        const std::string* end = nullptr;
+        std::vector<std::shared_ptr<SSTableMetadata>> outputs;
+        bool ok = true;
+        std::string error;
+    };
 
-        for (int i = 0; i < numHashes; i++) {
-            size_t bitIndex = (h1 + i * h2) % sizeInBits;
-            bitArray[bitIndex] = true;
+    // Split keys for a compaction, taken from the inputs' block index so each range
+    // covers about the same number of blocks. Ranges are kept to at least 16 blocks;
+    // below that the thread is not worth it. Each split is the first version of a user
+    // key, so no key's versions are spread over two ranges. With maxSubcompactions at 1
+    // the indexes are not read at all.
+    std::vector<std::string> subcompactionBoundaries(const Compaction& c) {
+        if (options.maxSubcompactions <= 1) return {};
+        std::vector<std::string> keys;
+        for (const auto& files : c.inputs) {
+            for (const auto& meta : files) {
+                IndexIterator index = newIndexIterator(*meta, false, verifyCompactionReads());
+                for (index.seekToFirst(); index.valid(); index.next()) keys.push_back(firstVersionKey(index.entry().key));
+            }
+        }
+        size_t ranges = std::min<size_t>(options.maxSubcompactions, keys.size() / 16);
+        if (ranges <= 1) return {};
+
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        std::vector<std::string> boundaries;
+        for (size_t i = 1; i < ranges; i++) {
+            const std::string& key = keys[i * keys.size() / ranges];
+            if (boundaries.empty() || boundaries.back() < key) boundaries.push_back(key);
         }
+        return boundaries;
     }
 
-    bool possiblyContains(const std::string& key) const {
-        if (sizeInBits == 0) return false;
-        
-        std::hash<std::string> hash1;
-        std::hash<std::string> hash2;
+    // Merges one range of the inputs into new files at level + 1. Of each user key's
+    // versions it keeps those newer than the oldest snapshot plus the newest one that
+    // snapshot can see; a deletion that is that one goes too when nothing older can sit
+    // below. Files are only cut between user keys. On failure the range's outputs are
+    // removed, sub.ok is cleared and sub.error says why.
+    void runSubcompaction(const Compaction& c, Subcompaction& sub) {
+        int outputLevel = c.level + 1;
 
-        size_t h1 = hash1(key);
-        size_t h2 = hash2(key + "_salt");
+        // Newest first: the level above before the level below, and newer L0 files
+        // before older ones.
+        std::vector<std::unique_ptr<Iterator>> sources;
+        for (auto it = c.inputs[0].rbegin(); it != c.inputs[0].rend(); ++it) {
+            sources.push_back(newTableIterator(*it, false, verifyCompactionReads()));
+        }
+        for (const auto& meta : c.inputs[1]) sources.push_back(newTableIterator(meta, false, verifyCompactionReads()));
+        MergingIterator merged(std::move(sources));
 
-        for (int i = 0; i < numHashes; i++) {
-            size_t bitIndex = (h1 + i * h2) % sizeInBits;
-            if (!bitArray[bitIndex]) {
-                return false; 
+        std::unique_ptr<SSTableBuilder> builder;
+        uint64_t fileNumber = 0;
+        auto finishOutput = [&]() {
+            SSTableMetadata built;
+            if (!builder->finish(built)) return false;
+            builder.reset();
+            auto meta = adoptTable(std::move(built));
+            meta->fileNumber = fileNumber;
+            sub.outputs.push_back(meta);
+            return true;
+        };
+        auto abandon = [&](const std::string& reason) {
+            sub.error = reason;
+            std::error_code ec;
+            if (builder) {
+                builder.reset();
+                std::filesystem::remove(tableFileName(outputLevel, fileNumber), ec);
             }
-        }
-        return true; 
-    }
+            for (const auto& meta : sub.outputs) std::filesystem::remove(meta->filename, ec);
+            sub.outputs.clear();
+            sub.ok = false;
+        };
 
-    void serialize(Buffer& buffer) const {
-        encodeLength(buffer, (uint32_t)numHashes);
-        encodeLength(buffer, (uint32_t)sizeInBits);
-        
-        int numBytes = (sizeInBits + 7) / 8;
-        for (int i = 0; i < numBytes; i++) {
-            uint8_t byte = 0;
-            for (int bit = 0; bit < 8; bit++) {
-                int index = i * 8 + bit;
-                if (index < sizeInBits && bitArray[index]) {
-                    byte |= (1 << bit);
+        std::string currentUserKey;
+        bool hasCurrentUserKey = false;
+        uint64_t lastSequenceForKey = MAX_SEQUENCE;
+
+        if (sub.start) {
+            merged.seek(*sub.start);
+        } else {
+            merged.seekToFirst();
+        }
+        for (; merged.valid(); merged.next()) {
+            std::string_view key = merged.key();
+            if (sub.end && key >= *sub.end) break;
+            if (!hasCurrentUserKey || encodedUserKey(key) != currentUserKey) {
+                if (builder && builder->estimatedSize() >= options.maxFileSize && !finishOutput()) {
+                    abandon("cannot write " + tableFileName(outputLevel, fileNumber));
+                    return;
                 }
+                currentUserKey.assign(encodedUserKey(key));
+                hasCurrentUserKey = true;
+                lastSequenceForKey = MAX_SEQUENCE;
             }
-            buffer.push_back(byte);
-        }
-    }
 
-    static BloomFilter deserialize(const Buffer& buffer, size_t& offset) {
-        BloomFilter bf;
-        bf.numHashes = decodeLength(buffer, offset);
-        bf.sizeInBits = decodeLength(buffer, offset);
-        
-        bf.bitArray.resize(bf.sizeInBits);
-        int numBytes = (bf.sizeInBits + 7) / 8;
-
-        for (int i = 0; i < numBytes; i++) {
-            if (offset >= buffer.size()) break;
-            uint8_t byte = buffer[offset++];
-            for (int bit = 0; bit < 8; bit++) {
-                int index = i * 8 + bit;
-                if (index < bf.sizeInBits) {
-                    bf.bitArray[index] = (byte & (1 << bit)) != 0;
+            uint64_t sequence = keySequence(key);
+            bool drop = lastSequenceForKey <= c.smallestSnapshot ||
+                        (c.dropTombstones && keyType(key) == ValueType::Deletion && sequence <= c.smallestSnapshot);
+            lastSequenceForKey = sequence;
+            if (drop) continue;
+
+            if (!builder) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    fileNumber = nextFileNumber++;
+                }
+                builder = std::make_unique<SSTableBuilder>(tableFileName(outputLevel, fileNumber), options,
+                                                           outputLevel, rateLimiter.get());
+                if (!builder->isOpen()) {
+                    abandon("cannot create " + tableFileName(outputLevel, fileNumber));
+                    return;
                 }
             }
+            builder->add(key, merged.value());
         }
-        return bf;
+        // Installing a partial merge would lose whatever the unreadable block held.
+        if (!merged.ok()) {
+            abandon("unreadable input block");
+            return;
+        }
+        if (builder && !finishOutput()) abandon("cannot write " + tableFileName(outputLevel, fileNumber));
     }
-};
 
-// --- Structures ---
+    void compactionLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            Compaction c;
+            compactionCv.wait(lock, [&]() { return shuttingDown || (!manualCompaction && pickCompaction(c)); });
+            if (shuttingDown) return;
 
-struct IndexEntry {
-    std::string key;
-    uint32_t offset;
-};
+            runningCompactions++;
+            lock.unlock();
+            runCompaction(c, true);
+            lock.lock();
+            runningCompactions--;
 
-struct SSTableMetadata {
-    std::string filename;
-    std::vector<IndexEntry> sparseIndex;
-    BloomFilter bloomFilter; 
-};
+            for (const auto& files : c.inputs) {
+                for (const auto& meta : files) meta->beingCompacted = false;
+            }
+            // Stalled writers, a waiting compact() and idle compaction threads may all proceed.
+            bgCv.notify_all();
+            compactionCv.notify_all();
+        }
+    }
 
-const int MAX_LEVEL = 6;
+    // Caller holds mutex and the write token, and imm is empty.
+    void switchMemTable() {
+        imm = mem;
+        immLogNumber = logNumber;
+        mem = std::make_shared<MemTable>();
+        installSuperVersion();
+        logNumber = nextLogNumber++;
+        if (!wal.open(walFileName(logNumber), true, options.walSyncMode, options.walSyncIntervalMs)) {
+            recordBackgroundError("cannot open " + walFileName(logNumber));
+        }
+        bgCv.notify_all();
+    }
 
-struct Node {
-    std::string key;   
-    std::string value; 
-    Node** forward;
-    int nodeLevel;
+    // Called by the write leader. Once L0 reaches the slowdown trigger each group is
+    // delayed by 1 ms, handing some throughput to compaction well before the hard stop.
+    // Blocks if mem is full while the previous memtable is still being flushed or L0
+    // is at the stop trigger.
+    // Returns false once the store has a background error.
+    bool makeRoomForWrite() {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool allowDelay = true;
+        while (true) {
+            if (!backgroundError.empty()) {
+                return false;
+            } else if (allowDelay && current->levels[0].size() >= static_cast<size_t>(options.level0SlowdownTrigger)) {
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                allowDelay = false;
+                lock.lock();
+            } else if (mem->approximateMemoryUsage() < options.memtableSize) {
+                break;
+            } else if (imm || current->levels[0].size() >= static_cast<size_t>(options.level0StopTrigger)) {
+                bgCv.wait(lock);
+            } else {
+                switchMemTable();
+                break;
+            }
+        }
+        return true;
+    }
 
-    Node(std::string k, std::string v, int level) {
-        key = k;
-        value = v;
-        nodeLevel = level;
-        forward = new Node*[level + 1];
-        memset(forward, 0, sizeof(Node*) * (level + 1));
+    // Deletes a log whose records are now in an installed table. A log left behind would
+    // be replayed on the next open into an L0 table newer than everything flushed since,
+    // shadowing later writes to the same keys, so failing to delete it stops writes.
+    // Caller holds mutex.
+    void removeLogFile(const std::string& filename) {
+        std::error_code ec;
+        if (!std::filesystem::remove(filename, ec) && ec) {
+            recordBackgroundError("cannot remove " + filename + ": " + ec.message());
+        }
     }
 
-    ~Node() {
-        delete[] forward;
+    // Records the first background error and wakes writers waiting for room.
+    void setBackgroundError(const std::string& reason) {
+        std::lock_guard<std::mutex> lock(mutex);
+        recordBackgroundError(reason);
     }
-};
 
-// --- Main KVStore Class ---
+    // Same, for a caller that holds mutex.
+    void recordBackgroundError(const std::string& reason) {
+        if (!backgroundError.empty()) return;
+        std::cerr << reason << std::endl;
+        backgroundError = reason;
+        bgCv.notify_all();
+    }
 
-class KVStore {
-private:
-    Node* head;
-    int currentLevel;
-    std::ofstream walFile; 
-    const std::string walFileName = "wal.log";
-    const std::string manifestFileName = "MANIFEST";
-    
-    // Tombstone Constant
-    const std::string TOMBSTONE_VALUE = "~~DELETED~";
+    // Flushes imm whenever there is one. A failed flush is retried a few times, 100 ms
+    // apart, in case the cause was passing (a full disk being cleaned up); after that it
+    // becomes a background error and imm is left for recovery to replay from its segment.
+    // At shutdown a pending imm is still flushed once.
+    void flushLoop() {
+        const int maxAttempts = 3;
+        int failedAttempts = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            bgCv.wait(lock, [&]() { return (imm != nullptr && backgroundError.empty()) || shuttingDown; });
+            if (!imm || !backgroundError.empty()) return;
 
-    int sstCounter = 1; 
-    std::vector<SSTableMetadata> sstables;
+            std::shared_ptr<MemTable> table = imm;
+            uint64_t fileNumber = nextFileNumber++;
+            lock.unlock();
+            auto meta = writeLevel0Table(*table, fileNumber);
+            lock.lock();
 
-    // Helper for Compaction: Reads all Key-Values from a single SSTable
-    std::vector<std::pair<std::string, std::string>> readAllFromSSTable(const SSTableMetadata& meta) {
-        std::vector<std::pair<std::string, std::string>> data;
-        std::ifstream file(meta.filename, std::ios::binary | std::ios::ate);
-        if (!file.is_open()) return data;
+            // The WAL segment goes only once the table and the manifest naming it are
+            // durable. Until then imm (and its segment) stay.
+            auto version = meta ? std::make_shared<Version>(*current) : nullptr;
+            if (version) version->addFile(0, meta);
+            if (!version || !writeManifest(*version)) {
+                if (meta) meta->obsolete = true;
+                std::string reason = "flush to " + tableFileName(0, fileNumber) + " failed";
+                if (++failedAttempts >= maxAttempts) {
+                    recordBackgroundError(reason);
+                    continue;
+                }
+                std::cerr << reason << ", retrying" << std::endl;
+                // At shutdown recovery replays the segment instead.
+                if (shuttingDown) return;
+                bgCv.wait_for(lock, std::chrono::milliseconds(100));
+                continue;
+            }
+            failedAttempts = 0;
+            // current and imm change together, so readers never see the rows in neither.
+            current = version;
+            removeLogFile(walFileName(immLogNumber));
+            imm.reset();
+            installSuperVersion();
+            bgCv.notify_all();
+            compactionCv.notify_one();
+        }
+    }
 
-        size_t fileSize = file.tellg();
-        if (fileSize < 8) return data;
+    // Blocks until this writer is at the front of the queue.
+    void acquireWriteToken(Writer& w, std::unique_lock<std::mutex>& lock) {
+        writers.push_back(&w);
+        while (!w.done && &w != writers.front()) w.cv.wait(lock);
+    }
 
-        // 1. Read Footer to find where Data Block ends (which is Index Offset)
-        file.seekg(-8, std::ios::end);
-        char footerBuf[8];
-        file.read(footerBuf, 8);
-        
-        Buffer fBuf(8);
-        memcpy(fBuf.data(), footerBuf, 8);
-        size_t fOff = 0;
-        uint32_t indexOffset = decodeLength(fBuf, fOff); // Data ends here
-
-        // 2. Read Data Block
-        file.seekg(0, std::ios::beg);
-        Buffer buffer(indexOffset);
-        file.read(reinterpret_cast<char*>(buffer.data()), indexOffset);
-        
-        size_t offset = 0;
-        while (offset < buffer.size()) {
-            try {
-                uint32_t kLen = decodeLength(buffer, offset);
-                std::string k = decodeBytes(buffer, offset, kLen);
-                uint32_t vLen = decodeLength(buffer, offset);
-                std::string v = decodeBytes(buffer, offset, vLen);
-                data.push_back({k, v});
-            } catch (...) {
-                break;
+    // Pops the first n writers (the leader included), waking all but the leader with
+    // the group's result and handing the token to whoever is next.
+    void releaseWriteToken(Writer& leader, size_t n, bool ok) {
+        for (size_t i = 0; i < n; i++) {
+            Writer* member = writers.front();
+            writers.pop_front();
+            if (member != &leader) {
+                member->ok = ok;
+                member->done = true;
+                member->cv.notify_one();
             }
         }
-        return data;
+        if (!writers.empty()) writers.front()->cv.notify_one();
     }
 
 public:
-    KVStore() {
-        currentLevel = 0;
-        head = new Node("", "", MAX_LEVEL); 
+    explicit KVStore(const Options& opts = Options()) : options(opts) {
+        blockCache = options.blockCache ? options.blockCache
+                                        : std::make_shared<BlockCache>(options.blockCacheSize);
+        tableCache = std::make_shared<TableCache>(options.maxOpenFiles, options.useMmapReads);
+        mem = std::make_shared<MemTable>();
         
-        recover();
         loadManifest();
+        upgradeLegacyTables();
+        bool recovered = recoverLogs();
 
-        walFile.open(walFileName, std::ios::out | std::ios::app | std::ios::binary);
-        if (!walFile.is_open()) {
-            std::cerr << "wal not opened" << std::endl;
+        logNumber = nextLogNumber++;
+        if (!wal.open(walFileName(logNumber), true, options.walSyncMode, options.walSyncIntervalMs)) {
+            recordBackgroundError("cannot open " + walFileName(logNumber));
+        } else if (!recovered) {
+            relogMemTable();
+        }
+        if (options.compactionRateLimit > 0) {
+            rateLimiter = std::make_unique<RateLimiter>(options.compactionRateLimit);
+        }
+        installSuperVersion();
+        flushThread = std::thread(&KVStore::flushLoop, this);
+        for (int i = 0; i < std::max(1, options.maxBackgroundCompactions); i++) {
+            compactionThreads.emplace_back(&KVStore::compactionLoop, this);
         }
+        if (options.scrubIntervalMs > 0) scrubThread = std::thread(&KVStore::scrubLoop, this);
     }
 
     ~KVStore() {
-        if (walFile.is_open()) {
-            walFile.close();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shuttingDown = true;
         }
-       
-        Node* curr = head->forward[0];
-        while (curr != nullptr) {
-            Node* next = curr->forward[0];
-            delete curr;
-            curr = next;
-        }
-        delete head;
+        bgCv.notify_all();
+        compactionCv.notify_all();
+        flushThread.join();
+        for (auto& thread : compactionThreads) thread.join();
+        if (scrubThread.joinable()) scrubThread.join();
+        wal.close();
     }
 
+    // Binary manifest: [magic][varint64 nextFileNumber][varint64 lastSequence][varint32 count]
+    // then per table [varint32 level][varint64 fileNumber][name][smallest key][largest key]
+    // [varint64 size] (strings varint-length prefixed), and a trailing crc32c of everything
+    // before it. Stores from before it have a text MANIFEST, one table name per line.
+    static constexpr uint64_t MANIFEST_MAGIC = 0x4C534D4D414E3032ULL; // "LSMMAN02"
+
     void loadManifest() {
-        std::ifstream manifest(manifestFileName);
-        if (!manifest.is_open()) return;
+        std::ifstream inFile(manifestFileName, std::ios::in | std::ios::binary);
+        if (!inFile.is_open()) return;
+        Buffer data((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+        inFile.close();
+
+        auto version = std::make_shared<Version>();
+        uint64_t magic = data.size() < 8 ? 0 : getFixed64(data.data());
+        if (magic != MANIFEST_MAGIC) {
+            loadLegacyManifest(asView(data), *version);
+            current = version;
+            // Upgrade now so the level and key-range records exist from here on.
+            if (!writeManifest(*current)) throw std::runtime_error("cannot write " + manifestFileName);
+            return;
+        }
+
+        if (data.size() < 12 || crc32c(data.data(), data.size() - 4) != getFixed32(data.data() + data.size() - 4)) {
+            throw std::runtime_error("manifest checksum mismatch");
+        }
+        std::string_view view = asView(data).substr(0, data.size() - 4);
+        size_t offset = 8;
+        nextFileNumber = decodeVarint64(view, offset);
+        lastSequence = decodeVarint64(view, offset);
+        uint32_t count = decodeVarint32(view, offset);
+        std::vector<std::string> listed;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t level = decodeVarint32(view, offset);
+            uint64_t fileNumber = decodeVarint64(view, offset);
+            std::string filename(decodeView(view, offset, decodeVarint32(view, offset)));
+            std::string smallest(decodeView(view, offset, decodeVarint32(view, offset)));
+            std::string largest(decodeView(view, offset, decodeVarint32(view, offset)));
+            uint64_t fileSize = decodeVarint64(view, offset);
+            if (level >= static_cast<uint32_t>(NUM_LEVELS)) throw std::runtime_error("manifest level out of range");
+            listed.push_back(filename);
+
+            auto meta = loadSSTableMeta(filename);
+            if (!meta) {
+                std::cerr << "missing table " << filename << std::endl;
+                continue;
+            }
+            meta->fileNumber = fileNumber;
+            meta->smallestKey = std::move(smallest);
+            meta->largestKey = std::move(largest);
+            meta->fileSize = fileSize;
+            if (level == 0) pinFilters(*meta);
+            version->addFile(level, meta);
+        }
+        current = version;
+        removeObsoleteFiles(listed);
+    }
 
-        std::string filename;
-        int maxNum = 0;
+    // Removes tables the manifest does not list: inputs of a compaction that finished
+    // just before a crash (or that a reader was still using), and outputs of one that
+    // did not finish.
+    void removeObsoleteFiles(const std::vector<std::string>& live) {
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(".", ec)) {
+            // Only names this store generates, L<level>_<number>.sst.
+            std::string name = entry.path().filename().string();
+            size_t underscore = name.find('_');
+            if (name.size() < 8 || name[0] != 'L' || underscore == std::string::npos ||
+                underscore + 5 > name.size() || name.compare(name.size() - 4, 4, ".sst") != 0) {
+                continue;
+            }
+            auto allDigits = [](const std::string& str) {
+                return !str.empty() && std::all_of(str.begin(), str.end(), ::isdigit);
+            };
+            if (!allDigits(name.substr(1, underscore - 1)) ||
+                !allDigits(name.substr(underscore + 1, name.size() - underscore - 5))) {
+                continue;
+            }
+            if (std::find(live.begin(), live.end(), name) == live.end()) std::filesystem::remove(name, ec);
+        }
+    }
 
-        while (std::getline(manifest, filename)) {
+    // One filename per line, oldest first. Every table becomes an L0 table in that order.
+    void loadLegacyManifest(std::string_view contents, Version& version) {
+        uint64_t maxNum = 0;
+        size_t lineStart = 0;
+        while (lineStart < contents.size()) {
+            size_t lineEnd = contents.find('\n', lineStart);
+            if (lineEnd == std::string_view::npos) lineEnd = contents.size();
+            std::string filename(contents.substr(lineStart, lineEnd - lineStart));
+            lineStart = lineEnd + 1;
             if (filename.empty()) continue;
-            loadSSTableMeta(filename);
+
+            auto meta = loadSSTableMeta(filename);
+            if (!meta) continue;
+            IndexIterator index = newIndexIterator(*meta, false, false);
+            index.seekToFirst();
+            if (index.valid()) {
+                meta->smallestKey = index.entry().key;
+                index.seekToLast();
+                BlockContents last = index.valid() ? readDataBlock(*meta, index.entry(), false, false) : BlockContents();
+                if (last) {
+                    BlockIterator it(last.data, meta->formatVersion);
+                    for (it.seekToFirst(); it.valid(); it.next()) meta->largestKey = std::string(it.key());
+                }
+            }
 
             try {
               
@@ -274,220 +3823,677 @@ public:
                 if (start != std::string::npos && end != std::string::npos) {
                     std::string numPart = filename.substr(start + 1, end - start - 1);
                     if (isdigit(numPart[0])) {
-                        int num = std::stoi(numPart);
+                        uint64_t num = std::stoull(numPart);
+                        meta->fileNumber = num;
                         if (num > maxNum) maxNum = num;
                     }
                 }
             } catch(...) {}
+            version.addFile(0, meta);
         }
-        sstCounter = maxNum + 1;
-        manifest.close();
+        nextFileNumber = maxNum + 1;
     }
 
-    void appendToManifest(const std::string& filename) {
-        std::ofstream manifest(manifestFileName, std::ios::app);
-        if (manifest.is_open()) {
-            manifest << filename << "\n";
-            manifest.close();
+    // Rewrites every v1 table as v2. Old tables have no sequence numbers; newer data
+    // sits in shallower levels and, in L0, in later files, so each table in turn, oldest
+    // first, gets a sequence number of its own for all its records. A put of
+    // TOMBSTONE_VALUE becomes a deletion.
+    void upgradeLegacyTables() {
+        auto version = std::make_shared<Version>(*current);
+        std::vector<std::shared_ptr<SSTableMetadata>> replaced;
+        for (int level = NUM_LEVELS - 1; level >= 0; level--) {
+            for (auto& meta : version->levels[level]) {
+                if (meta->formatVersion != SSTABLE_FORMAT_V1) continue;
+
+                uint64_t sequence = ++lastSequence;
+                uint64_t fileNumber = nextFileNumber++;
+                SSTableBuilder builder(tableFileName(level, fileNumber), options, level);
+                if (!builder.isOpen()) throw std::runtime_error("cannot upgrade " + meta->filename);
+
+                std::string key;
+                auto it = newTableIterator(meta, false, false);
+                for (it->seekToFirst(); it->valid(); it->next()) {
+                    bool deleted = it->value() == TOMBSTONE_VALUE;
+                    key.clear();
+                    appendInternalKey(key, it->key(), sequence, deleted ? ValueType::Deletion : ValueType::Value);
+                    builder.add(key, deleted ? std::string_view() : it->value());
+                }
+                SSTableMetadata built;
+                if (!builder.finish(built)) {
+                    std::error_code ec;
+                    std::filesystem::remove(tableFileName(level, fileNumber), ec);
+                    throw std::runtime_error("cannot upgrade " + meta->filename + ": write failed");
+                }
+                auto upgraded = adoptTable(std::move(built));
+                upgraded->fileNumber = fileNumber;
+                if (level == 0) pinFilters(*upgraded);
+                if (!it->ok()) {
+                    upgraded->obsolete = true;
+                    throw std::runtime_error("cannot upgrade " + meta->filename + ": unreadable block");
+                }
+                replaced.push_back(meta);
+                meta = upgraded;
+            }
         }
-    }
+        if (replaced.empty()) return;
 
-    void loadSSTableMeta(const std::string& filename) {
-        std::ifstream file(filename, std::ios::binary | std::ios::ate);
-        if (!file.is_open()) return;
+        if (!writeManifest(*version)) throw std::runtime_error("cannot write " + manifestFileName);
+        current = version;
+        for (const auto& meta : replaced) meta->obsolete = true;
+    }
 
-        std::streampos fileSize = file.tellg();
-        if (fileSize < 8) return; 
+    // Rewrites the manifest from version via a temp file, fsynced, renamed over the old
+    // one, and a sync of the directory. Returns false, with the old manifest still in
+    // place, if any step fails. Caller holds mutex.
+    bool writeManifest(const Version& version) {
+        Buffer buf(8);
+        putFixed64(buf.data(), MANIFEST_MAGIC);
+        encodeVarint64(buf, nextFileNumber);
+        encodeVarint64(buf, lastSequence.load());
+        encodeVarint32(buf, version.fileCount());
+        for (int level = 0; level < NUM_LEVELS; level++) {
+            for (const auto& meta : version.levels[level]) {
+                encodeVarint32(buf, level);
+                encodeVarint64(buf, meta->fileNumber);
+                for (const std::string* str : {&meta->filename, &meta->smallestKey, &meta->largestKey}) {
+                    encodeVarint32(buf, str->size());
+                    encodeBytes(buf, *str);
+                }
+                encodeVarint64(buf, meta->fileSize);
+            }
+        }
+        uint32_t checksum = crc32c(buf.data(), buf.size());
+        size_t end = buf.size();
+        buf.resize(end + 4);
+        putFixed32(buf.data() + end, checksum);
 
-        file.seekg(-8, std::ios::end);
-        char buffer[8];
-        file.read(buffer, 8);
-        
-        Buffer footerBuf(8);
-        memcpy(footerBuf.data(), buffer, 8);
-        size_t footerOffset = 0;
-        uint32_t indexOffset = decodeLength(footerBuf, footerOffset);
-        uint32_t bloomOffset = decodeLength(footerBuf, footerOffset);
+        std::string tmpName = manifestFileName + ".tmp";
+        int fd = ::open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = writeFully(fd, buf.data(), buf.size()) && ::fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        std::error_code ec;
+        if (ok) std::filesystem::rename(tmpName, manifestFileName, ec);
+        if (!ok || ec) {
+            std::filesystem::remove(tmpName, ec);
+            return false;
+        }
+        return syncDirectory(".");
+    }
 
+    // Opens a table and reads its top-level index and prefix filter. Returns nullptr if
+    // the file cannot be opened. A bad footer, a v2 top-level index or prefix filter that
+    // fails its checksum (checked whatever the checksumMode: they are read once per open
+    // and a bad one would lose whole partitions) or an index that does not parse throws
+    // CorruptionError.
+    std::shared_ptr<SSTableMetadata> loadSSTableMeta(const std::string& filename) {
         SSTableMetadata meta;
         meta.filename = filename;
+        meta.fileId = newTableId();
+
+        auto file = tableCache->get(meta);
+        if (!file) return nullptr;
+        meta.fileSize = file->size();
+        auto corrupt = [&](const std::string& what) {
+            tableCache->evict(meta.fileId);
+            return CorruptionError(what + " in " + filename);
+        };
+
+        SSTableFooter footer;
+        if (!readFooter(*file, footer)) throw corrupt("bad footer");
+        meta.formatVersion = footer.version;
+
+        size_t indexSize = footer.bloomOffset - footer.indexOffset;
+        size_t bloomSize = file->size() - footer.size - footer.bloomOffset;
+        Buffer indexData(indexSize);
+        Buffer bloomData(bloomSize);
+        if (!file->read(footer.indexOffset, indexSize, indexData.data()) ||
+            !file->read(footer.bloomOffset, bloomSize, bloomData.data())) {
+            throw corrupt("unreadable index");
+        }
 
-       
-        file.seekg(indexOffset);
-        size_t indexSize = bloomOffset - indexOffset; 
-        std::vector<uint8_t> indexData(indexSize);
-        file.read(reinterpret_cast<char*>(indexData.data()), indexSize);
+        // Checks a v2 top-level block and strips its trailer.
+        auto unwrap = [&](Buffer& data, uint64_t offset, const std::string& what) {
+            size_t trailer = blockTrailerSize(meta.formatVersion);
+            if (data.size() < trailer || !blockChecksumMatches(asView(data), data.size() - trailer)) {
+                reportChecksumMismatch(meta, offset);
+                throw corrupt(what + " checksum mismatch");
+            }
+            data.resize(data.size() - trailer);
+        };
+        if (meta.formatVersion != SSTABLE_FORMAT_V1) {
+            unwrap(indexData, footer.indexOffset, "index");
+            unwrap(bloomData, footer.bloomOffset, "prefix filter");
+        }
 
+        std::string_view indexView = asView(indexData);
         size_t parseOffset = 0;
-        while (parseOffset < indexData.size()) {
-            try {
-                uint32_t keyLen = decodeLength(indexData, parseOffset);
-                std::string key = decodeBytes(indexData, parseOffset, keyLen);
-                uint32_t offsetVal = decodeLength(indexData, parseOffset);
-                meta.sparseIndex.push_back({key, offsetVal});
-            } catch (...) {
-                break;
+        try {
+            while (parseOffset < indexView.size()) {
+                if (meta.formatVersion == SSTABLE_FORMAT_V1) {
+                    uint32_t keyLen = decodeLength(indexView, parseOffset);
+                    std::string_view key = decodeView(indexView, parseOffset, keyLen);
+                    uint32_t offsetVal = decodeLength(indexView, parseOffset);
+                    meta.sparseIndex.push_back({std::string(key), offsetVal, 0});
+                } else {
+                    IndexPartition partition;
+                    uint32_t keyLen = decodeVarint32(indexView, parseOffset);
+                    partition.key = decodeView(indexView, parseOffset, keyLen);
+                    partition.offset = decodeVarint64(indexView, parseOffset);
+                    partition.size = decodeVarint32(indexView, parseOffset);
+                    partition.filterOffset = decodeVarint64(indexView, parseOffset);
+                    partition.filterSize = decodeVarint32(indexView, parseOffset);
+                    meta.indexPartitions.push_back(std::move(partition));
+                }
+            }
+        } catch (const std::exception&) {
+            throw corrupt("unparsable index");
+        }
+        if (meta.formatVersion == SSTABLE_FORMAT_V1) {
+            for (size_t i = 0; i < meta.sparseIndex.size(); i++) {
+                uint64_t end = (i + 1 < meta.sparseIndex.size()) ? meta.sparseIndex[i + 1].offset
+                                                                 : footer.indexOffset;
+                meta.sparseIndex[i].size = end - meta.sparseIndex[i].offset;
             }
         }
 
-       
-        file.seekg(bloomOffset);
-        size_t bloomSize = (size_t)fileSize - 8 - bloomOffset;
-        Buffer bloomData(bloomSize);
-        file.read(reinterpret_cast<char*>(bloomData.data()), bloomSize);
-        
+        std::string_view bloomView = asView(bloomData);
         size_t bloomParseOffset = 0;
-        meta.bloomFilter = BloomFilter::deserialize(bloomData, bloomParseOffset);
-        
-        sstables.push_back(meta);
-        file.close();
+        if (meta.formatVersion != SSTABLE_FORMAT_V1) {
+            if (bloomView.size() < 4) throw corrupt("truncated prefix filter");
+            uint32_t prefixLength = decodeLength(bloomView, bloomParseOffset);
+            if (prefixLength > 0) {
+                meta.prefixFilter = BloomFilter::deserialize(bloomView, bloomParseOffset);
+                meta.prefixLength = prefixLength;
+            }
+        }
+
+        return adoptTable(std::move(meta));
     }
 
-    int randomLevel() {
-        int lvl = 0;
-        while ((rand() % 2) == 1 && lvl < MAX_LEVEL) {
-            lvl++;
+    // Safe to call from several threads at once, alongside get(), flush() and compact().
+    // The batch is one WAL record, so recovery applies all of it or none, and reads see
+    // either none of it or all of it. Returns false, with nothing applied, when the
+    // group's log write or sync fails; the store then refuses further writes (see
+    // getBackgroundError()), since the log may end in a partial record.
+    bool write(const WriteBatch& batch) {
+        if (batch.count() == 0) return true;
+
+        Writer w;
+        w.batch = &batch;
+
+        std::unique_lock<std::mutex> lock(writeMutex);
+        acquireWriteToken(w, lock);
+        if (w.done) return w.ok;
+
+        // Leader: commit everyone queued so far, up to a pending flush() request.
+        // Later arrivals wait for the next group.
+        std::vector<Writer*> group;
+        for (Writer* member : writers) {
+            if (!member->batch) break;
+            group.push_back(member);
         }
-        return lvl;
-    }
+        lock.unlock();
 
-    void put(std::string key, std::string value) {
-        Buffer logEntry;
-        encodeLength(logEntry, key.size());
-        encodeBytes(logEntry, key);
-        encodeLength(logEntry, value.size());
-        encodeBytes(logEntry, value);
+        bool ok = makeRoomForWrite();
+        if (ok) {
+            // Reused across groups so the steady-state write path does not allocate.
+            thread_local Buffer logEntry;
+            logEntry.clear();
+            uint64_t firstSequence = lastSequence.load(std::memory_order_relaxed) + 1;
+            uint64_t sequence = firstSequence;
+            for (Writer* member : group) {
+                encodeWalRecord(logEntry, sequence, member->batch->contents());
+                sequence += member->batch->count();
+            }
 
-        if (walFile.is_open()) {
-            walFile.write(reinterpret_cast<const char*>(logEntry.data()), logEntry.size());
-            walFile.flush(); 
+            if (!wal.isOpen() || !wal.append(logEntry)) {
+                setBackgroundError("wal write failed");
+                ok = false;
+            }
+            if (ok) {
+                sequence = firstSequence;
+                for (Writer* member : group) {
+                    applyBatch(*mem, member->batch->contents(), sequence);
+                    sequence += member->batch->count();
+                }
+                lastSequence.store(sequence - 1, std::memory_order_release);
+            }
         }
-        insertInMemory(key, value);
+
+        lock.lock();
+        releaseWriteToken(w, group.size(), ok);
+        return ok;
+    }
+
+    bool put(const std::string& key, const std::string& value) {
+        WriteBatch batch;
+        batch.put(key, value);
+        return write(batch);
     }
 
    
-    void del(std::string key) {
-        put(key, TOMBSTONE_VALUE);
+    bool del(const std::string& key) {
+        WriteBatch batch;
+        batch.del(key);
+        return write(batch);
     }
 
-    void insertInMemory(std::string key, std::string value) {
-        Node* current = head;
-        Node* update[MAX_LEVEL + 1];
-        memset(update, 0, sizeof(Node*) * (MAX_LEVEL + 1));
+    // Inserts the batch's entries into table as sequence, sequence + 1, ...
+    static void applyBatch(MemTable& table, std::string_view contents, uint64_t sequence) {
+        thread_local std::string key;
+        WriteBatch::forEach(contents, [&](BatchOp op, std::string_view userKey, std::string_view value) {
+            key.clear();
+            appendInternalKey(key, userKey, sequence++, op == BatchOp::Delete ? ValueType::Deletion : ValueType::Value);
+            table.insert(key, value);
+        });
+    }
+
+    // A read of everything written so far. Release it with releaseSnapshot().
+    const Snapshot* getSnapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t sequence = lastSequence.load(std::memory_order_acquire);
+        snapshots.insert(sequence);
+        return new Snapshot(sequence);
+    }
+
+    void releaseSnapshot(const Snapshot* snapshot) {
+        if (!snapshot) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            snapshots.erase(snapshots.find(snapshot->sequence()));
+        }
+        delete snapshot;
+    }
 
-        for (int i = currentLevel; i >= 0; i--) {
-            while (current->forward[i] != nullptr && current->forward[i]->key < key) {
-                current = current->forward[i];
+    bool get(const std::string& key, PinnableSlice& value) { return get(ReadOptions(), key, value); }
+
+    // Zero-copy lookup: on an SSTable hit, value points into the block it was found in.
+    // Searches mem, imm, L0 newest to oldest, then at most one file per deeper level,
+    // all from one SuperVersion, so a flush or compaction finishing meanwhile cannot
+    // hide a key or pull a file out from under the search. Never takes the store's mutex.
+    // The first version at or below the read's sequence number decides the result. A
+    // table block on the way that fails its checksum or cannot be read throws
+    // CorruptionError; the search never falls through to older versions below it.
+    bool get(const ReadOptions& readOptions, const std::string& key, PinnableSlice& value) {
+        uint64_t sequence = readOptions.snapshot ? readOptions.snapshot->sequence()
+                                                 : lastSequence.load(std::memory_order_acquire);
+        std::shared_ptr<const SuperVersion> sv = acquireSuperVersion();
+        const auto& tables = sv->version->levels;
+        std::string lookup = internalKey(key, sequence, ValueType::Value);
+        std::string_view userKey = encodedUserKey(lookup);
+        uint64_t keyHash = BloomFilter::hashKey(userKey);
+
+        value.reset();
+        for (const MemTable* table : {sv->mem.get(), sv->imm.get()}) {
+            if (!table) continue;
+            const Node* node = table->seek(lookup);
+            if (node != nullptr && encodedUserKey(node->key()) == userKey) {
+                if (keyType(node->key()) == ValueType::Deletion) return false;
+                value.pinSelf(node->value());
+                return true;
             }
-            update[i] = current;
         }
-        current = current->forward[0];
 
-        if (current != nullptr && current->key == key) {
-            current->value = value;
-            return;
+        // true once the newest visible version of key has been seen, live or deleted.
+        bool deleted = false;
+        auto searchTable = [&](const SSTableMetadata& meta) {
+            if (userKey < encodedUserKey(meta.smallestKey) || userKey > encodedUserKey(meta.largestKey)) return false;
+            if (!filterMayContain(meta, lookup, keyHash)) return false;
+            return searchInSSTable(meta, lookup, value, deleted);
+        };
+        auto result = [&]() {
+            if (deleted) {
+                value.reset();
+                return false;
+            }
+            return true;
+        };
+
+        for (auto it = tables[0].rbegin(); it != tables[0].rend(); ++it) {
+            if (searchTable(**it)) return result();
+        }
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            const auto& files = tables[level];
+            auto it = std::lower_bound(files.begin(), files.end(), lookup,
+                [](const std::shared_ptr<SSTableMetadata>& meta, const std::string& k) {
+                    return meta->largestKey < k;
+                });
+            if (it != files.end() && searchTable(**it)) return result();
         }
 
-        int rLevel = randomLevel();
-        if (rLevel > currentLevel) {
-            for (int i = currentLevel + 1; i <= rLevel; i++) {
-                update[i] = head;
+        return false; 
+    }
+
+    std::string get(std::string key) { return get(ReadOptions(), key); }
+
+    // Ordered scan over everything in the store, as of readOptions.snapshot or of now,
+    // limited to readOptions' bounds and prefix. With ReadOptions::prefix = "user:",
+    // seekToFirst() then next() while valid() is a prefix query that only opens the
+    // tables that may hold such keys.
+    // The iterator keeps its memtables and tables alive and must not outlive the store.
+    std::unique_ptr<Iterator> newIterator(const ReadOptions& readOptions = ReadOptions()) {
+        uint64_t sequence = readOptions.snapshot ? readOptions.snapshot->sequence()
+                                                 : lastSequence.load(std::memory_order_acquire);
+        std::shared_ptr<const SuperVersion> sv = acquireSuperVersion();
+
+        auto encode = [](std::string_view userKey) {
+            return std::string(encodedUserKey(internalKey(userKey, 0, ValueType::Value)));
+        };
+        std::string lower = readOptions.lowerBound.empty() ? "" : encode(readOptions.lowerBound);
+        std::string upper = readOptions.upperBound.empty() ? "" : encode(readOptions.upperBound);
+        std::string prefix;
+        if (!readOptions.prefix.empty()) {
+            std::string first = encode(readOptions.prefix);
+            prefix.assign(encodedKeyPrefix(first, first.size()));
+            if (lower.empty() || lower < first) lower = first;
+            // Keys with the prefix sort below the prefix with its last non-0xFF byte
+            // incremented; a prefix of only 0xFF bytes has no such bound.
+            std::string end = readOptions.prefix;
+            while (!end.empty() && static_cast<uint8_t>(end.back()) == 0xFF) end.pop_back();
+            if (!end.empty()) {
+                end.back() = static_cast<char>(static_cast<uint8_t>(end.back()) + 1);
+                std::string last = encode(end);
+                if (upper.empty() || last < upper) upper = last;
             }
-            currentLevel = rLevel;
         }
+        auto wanted = [&](const SSTableMetadata& meta) {
+            return meta.mayContainRange(lower, upper) && (prefix.empty() || meta.mayContainPrefix(prefix));
+        };
 
-        Node* n = new Node(key, value, rLevel);
-        for (int i = 0; i <= rLevel; i++) {
-            n->forward[i] = update[i]->forward[i];
-            update[i]->forward[i] = n;
+        // Newest source first: mem, imm, L0 newest to oldest, then one per deeper level.
+        std::vector<std::unique_ptr<Iterator>> children;
+        children.push_back(std::make_unique<MemTableIterator>(sv->mem.get()));
+        if (sv->imm) children.push_back(std::make_unique<MemTableIterator>(sv->imm.get()));
+        const auto& levels = sv->version->levels;
+        for (auto it = levels[0].rbegin(); it != levels[0].rend(); ++it) {
+            if (wanted(**it)) children.push_back(newTableIterator(*it, true, verifyReads()));
+        }
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            std::vector<std::shared_ptr<SSTableMetadata>> files;
+            for (const auto& meta : levels[level]) {
+                if (wanted(*meta)) files.push_back(meta);
+            }
+            if (files.empty()) continue;
+            children.push_back(std::make_unique<LevelIterator>(std::move(files),
+                [this](const std::shared_ptr<SSTableMetadata>& meta) {
+                    return newTableIterator(meta, true, verifyReads());
+                }));
         }
+        return std::make_unique<DBIterator>(std::move(sv), std::move(children), sequence, std::move(lower),
+                                            std::move(upper));
     }
 
-    std::string get(std::string key) {
-       
-        Node* current = head;
-        for (int i = currentLevel; i >= 0; i--) {
-            while (current->forward[i] != nullptr && current->forward[i]->key < key) {
-                current = current->forward[i];
-            }
+    std::string get(const ReadOptions& readOptions, const std::string& key) {
+        PinnableSlice value;
+        if (!get(readOptions, key, value)) return "";
+        return value.toString();
+    }
+
+    // Looks for the first entry at or after lookup; true if it is a version of the same
+    // user key, with deleted telling whether that version is a deletion. Throws
+    // CorruptionError if an index partition or data block on the way cannot be read.
+    bool searchInSSTable(const SSTableMetadata& meta, std::string_view lookup, PinnableSlice& value, bool& deleted) {
+        // Last block whose first key is <= lookup; the entry may also be the first of the next.
+        IndexIterator index = newIndexIterator(meta, true, verifyReads());
+        for (index.seek(lookup); index.valid(); index.next()) {
+            BlockContents block = readDataBlock(meta, index.entry(), true, verifyReads());
+            if (!block) throw CorruptionError("unreadable block in " + meta.filename);
+
+            BlockIterator blockIt(block.data, meta.formatVersion);
+            blockIt.seek(lookup);
+            if (!blockIt.valid()) continue;
+            if (encodedUserKey(blockIt.key()) != encodedUserKey(lookup)) return false;
+            deleted = keyType(blockIt.key()) == ValueType::Deletion;
+            if (!deleted) value.pinShared(blockIt.value(), block.pin);
+            return true;
         }
-        current = current->forward[0];
+        if (!index.ok()) throw CorruptionError("unreadable index partition in " + meta.filename);
+        return false;
+    }
 
-        if (current != nullptr && current->key == key) {
-            if (current->value == TOMBSTONE_VALUE) return ""; 
-            return current->value; 
-        } 
+    // One wal_NNNNNN.log during recovery: its records, the memtable they are replayed
+    // into and the L0 table that becomes.
+    struct LogSegment {
+        uint64_t number = 0;
+        std::shared_ptr<RandomAccessFile> file;
+        Buffer contents; // the file's bytes when it could not be mapped
+        std::string_view data;
+        // Payload offset and length of each complete record, in file order.
+        std::vector<std::pair<size_t, uint32_t>> records;
+        // Bytes after the last record that are not one: a write cut off by a crash
+        // (torn) or a record header that fails its checksum with data after it.
+        bool fragment = false;
+        bool fragmentTorn = false;
 
-       
-        for (int i = sstables.size() - 1; i >= 0; i--) {
-            if (!sstables[i].bloomFilter.possiblyContains(key)) {
-                continue;
+        std::shared_ptr<MemTable> table;
+        uint64_t fileNumber = 0;
+        std::shared_ptr<SSTableMetadata> meta;
+    };
+
+    // Runs fn(i) for i in [0, n) on up to walRecoveryThreads threads.
+    void parallelFor(size_t n, const std::function<void(size_t)>& fn) {
+        size_t threads = options.walRecoveryThreads > 0 ? options.walRecoveryThreads
+                                                        : std::max(1u, std::thread::hardware_concurrency());
+        threads = std::min(threads, n);
+        std::atomic<size_t> next{0};
+        auto work = [&]() {
+            for (size_t i = next++; i < n; i = next++) fn(i);
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; t++) workers.emplace_back(work);
+        work();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Maps (or reads) a segment and finds its record boundaries. Returns false if the
+    // file cannot be read. A segment cut off inside its magic is a torn write; one with
+    // the wrong magic is corrupt.
+    bool openLogSegment(uint64_t number, LogSegment& segment) {
+        segment.number = number;
+        segment.file = RandomAccessFile::open(walFileName(number), true);
+        if (!segment.file) return false;
+        uint64_t size = segment.file->size();
+        if (segment.file->isMapped()) {
+            segment.data = segment.file->view(0, size);
+        } else {
+            segment.contents.resize(size);
+            if (!segment.file->read(0, size, segment.contents.data())) return false;
+            segment.data = asView(segment.contents);
+        }
+        if (segment.data.size() < WAL_HEADER_SIZE ||
+            getFixed64(reinterpret_cast<const uint8_t*>(segment.data.data())) != WAL_MAGIC) {
+            segment.fragment = true;
+            segment.fragmentTorn = segment.data.size() < WAL_HEADER_SIZE;
+            return true;
+        }
+
+        // The length is only trusted once the header checksum matches; a header that
+        // does not is a torn write only if nothing but zeros comes after it.
+        size_t offset = WAL_HEADER_SIZE;
+        while (offset < segment.data.size()) {
+            size_t left = segment.data.size() - offset;
+            const uint8_t* header = reinterpret_cast<const uint8_t*>(segment.data.data()) + offset;
+            if (left < WAL_RECORD_HEADER_SIZE) {
+                segment.fragment = segment.fragmentTorn = true;
+                break;
+            }
+            if (!walRecordHeaderMatches(header)) {
+                segment.fragment = true;
+                segment.fragmentTorn = allZeros(segment.data.substr(offset + WAL_RECORD_HEADER_SIZE));
+                break;
             }
-            
-            std::string res = searchInSSTable(sstables[i], key);
-            if (!res.empty()) {
-                if (res == TOMBSTONE_VALUE) return ""; 
-                return res;
+            uint32_t length = getFixed32(header);
+            if (length > left - WAL_RECORD_HEADER_SIZE) {
+                segment.fragment = segment.fragmentTorn = true;
+                break;
             }
+            segment.records.push_back({offset + WAL_RECORD_HEADER_SIZE, length});
+            offset += WAL_RECORD_HEADER_SIZE + length;
         }
+        return true;
+    }
 
-        return ""; 
+    static bool allZeros(std::string_view bytes) {
+        return std::all_of(bytes.begin(), bytes.end(), [](char c) { return c == 0; });
     }
 
-    std::string searchInSSTable(const SSTableMetadata& meta, const std::string& key) {
-        if (meta.sparseIndex.empty()) return "";
+    // Whether a record is intact: checksum, sequence number and a batch that decodes.
+    static bool checkLogRecord(const LogSegment& segment, size_t i) {
+        auto [offset, length] = segment.records[i];
+        std::string_view payload = segment.data.substr(offset, length);
+        uint32_t checksum = getFixed32(reinterpret_cast<const uint8_t*>(segment.data.data()) + offset - 8);
+        return crc32c(payload) == checksum && payload.size() >= 8 && WriteBatch::isValid(payload.substr(8));
+    }
 
-        auto it = std::lower_bound(meta.sparseIndex.begin(), meta.sparseIndex.end(), key,
-            [](const IndexEntry& entry, const std::string& val) {
-                return entry.key < val;
-            });
+    // A bad record is a torn write if nothing but zeros follows it: the file may have
+    // been extended with zeros past a cut-off append.
+    static bool isTornWrite(const LogSegment& segment, size_t record) {
+        auto [offset, length] = segment.records[record];
+        return allZeros(segment.data.substr(offset + length));
+    }
 
-        uint32_t searchOffset = 0;
+    // Replays every WAL on disk and writes what it held to L0, so the logs can go: a
+    // pre-segment wal.log first, one record at a time into mem; then the segments.
+    // Those are checked and replayed on walRecoveryThreads threads, record by record,
+    // each segment into a memtable of its own, and the memtables are written to L0 in
+    // parallel. Sequence numbers come from
+    // the records, so the order records are inserted in does not matter. Returns false if
+    // the tables could not be installed, leaving the records in mem and the logs on disk.
+    bool recoverLogs() {
+        replayLogFile(legacyWalFileName);
+        std::vector<LogSegment> segments;
+        for (uint64_t number : listLogNumbers()) {
+            nextLogNumber = std::max(nextLogNumber, number + 1);
+            LogSegment segment;
+            if (!openLogSegment(number, segment)) {
+                throw std::runtime_error("cannot read " + walFileName(number));
+            }
+            segments.push_back(std::move(segment));
+        }
 
-        if (it != meta.sparseIndex.end() && it->key == key) {
-            searchOffset = it->offset;
-        } 
-        else if (it != meta.sparseIndex.begin()) {
-            it--;
-            searchOffset = it->offset;
-        } 
-        else {
-            return ""; 
+        // (segment, record) of every record, so the threads split the work evenly
+        // however it is spread over the segments.
+        std::vector<std::pair<size_t, size_t>> records;
+        for (size_t s = 0; s < segments.size(); s++) {
+            for (size_t r = 0; r < segments[s].records.size(); r++) records.push_back({s, r});
         }
+        std::vector<uint8_t> intact(records.size());
+        parallelFor(records.size(), [&](size_t i) {
+            intact[i] = checkLogRecord(segments[records[i].first], records[i].second);
+        });
 
-        std::ifstream file(meta.filename, std::ios::binary);
-        if (!file.is_open()) return "";
+        // Cut the log at its first bad record, or fail if the mode does not allow that.
+        size_t keep = 0;
+        for (size_t s = 0; s < segments.size(); s++) {
+            const LogSegment& segment = segments[s];
+            size_t r = 0;
+            while (r < segment.records.size() && intact[keep + r]) r++;
+            keep += r;
+            if (r == segment.records.size() && !segment.fragment) continue;
 
-        file.seekg(searchOffset);
+            bool torn = r == segment.records.size() ? segment.fragmentTorn : isTornWrite(segment, r);
+            if (torn && s + 1 == segments.size()) break;
+            std::string where = walFileName(segment.number);
+            if (options.walRecoveryMode == WalRecoveryMode::TolerateTornTail) {
+                throw std::runtime_error(std::string(torn ? "torn write" : "corrupted record") + " in " + where);
+            }
+            std::cerr << "WAL " << where << (torn ? " has a torn write" : " is corrupted")
+                      << "; dropping it from there on and every later log" << std::endl;
+            break;
+        }
 
-        Buffer buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-        size_t offset = 0;
+        for (auto& segment : segments) segment.table = std::make_shared<MemTable>();
+        parallelFor(keep, [&](size_t i) {
+            LogSegment& segment = segments[records[i].first];
+            auto [offset, length] = segment.records[records[i].second];
+            std::string_view payload = segment.data.substr(offset, length);
+            applyBatch(*segment.table, payload.substr(8),
+                       getFixed64(reinterpret_cast<const uint8_t*>(payload.data())));
+        });
+        for (size_t i = 0; i < keep; i++) {
+            auto [offset, length] = segments[records[i].first].records[records[i].second];
+            const uint8_t* payload = reinterpret_cast<const uint8_t*>(segments[records[i].first].data.data()) + offset;
+            uint64_t last = getFixed64(payload) + getFixed32(payload + 8) - 1;
+            lastSequence = std::max<uint64_t>(lastSequence, last);
+        }
 
-        while (offset < buffer.size()) {
-            try {
-                uint32_t kLen = decodeLength(buffer, offset);
-                std::string k = decodeBytes(buffer, offset, kLen);
-                uint32_t vLen = decodeLength(buffer, offset);
-                std::string v = decodeBytes(buffer, offset, vLen);
+        // Oldest first: what the pre-segment wal.log left in mem, then the segments.
+        std::vector<std::shared_ptr<MemTable>> tables;
+        if (!mem->empty()) tables.push_back(mem);
+        for (auto& segment : segments) {
+            if (!segment.table->empty()) tables.push_back(segment.table);
+        }
+        mem = std::make_shared<MemTable>();
+        std::vector<std::shared_ptr<SSTableMetadata>> written(tables.size());
+        std::vector<uint64_t> fileNumbers(tables.size());
+        for (auto& number : fileNumbers) number = nextFileNumber++;
+        parallelFor(tables.size(), [&](size_t i) { written[i] = writeLevel0Table(*tables[i], fileNumbers[i]); });
 
-                if (k == key) return v;
-                if (k > key) break; 
+        if (std::all_of(written.begin(), written.end(), [](const auto& meta) { return meta != nullptr; })) {
+            auto version = std::make_shared<Version>(*current);
+            for (auto& meta : written) version->addFile(0, meta);
+            if (written.empty() || writeManifest(*version)) {
+                current = version;
+                removeLogFile(legacyWalFileName);
+                for (uint64_t number : listLogNumbers()) removeLogFile(walFileName(number));
+                return true;
+            }
+        }
 
-            } catch (...) {
-                break; 
+        // A table or the manifest could not be written: keep the logs and serve
+        // everything from mem until relogMemTable() has moved it to the new segment.
+        for (auto& meta : written) {
+            if (meta) meta->obsolete = true;
+        }
+        for (const auto& table : tables) {
+            for (const Node* node = table->first(); node != nullptr; node = node->next(0)) {
+                mem->insert(node->key(), node->value());
             }
         }
+        return false;
+    }
 
-        return "";
+    // Writes what recovery left in mem to the newly opened segment, one record per entry
+    // under its own sequence number, and deletes the logs it came from once that is
+    // durable. Flushing mem then retires everything with the new segment; the old logs,
+    // if kept, would be replayed on a later open into an L0 table newer than anything
+    // flushed in between and shadow later writes to the same keys.
+    void relogMemTable() {
+        Buffer records;
+        WriteBatch batch;
+        for (const Node* node = mem->first(); node != nullptr; node = node->next(0)) {
+            std::string key = decodeUserKey(encodedUserKey(node->key()));
+            batch.clear();
+            if (keyType(node->key()) == ValueType::Deletion) {
+                batch.del(key);
+            } else {
+                batch.put(key, node->value());
+            }
+            encodeWalRecord(records, keySequence(node->key()), batch.contents());
+        }
+        if (!wal.append(records) || !wal.sync() || !syncDirectory(".")) {
+            recordBackgroundError("cannot copy the recovered logs into " + walFileName(logNumber));
+            return;
+        }
+        removeLogFile(legacyWalFileName);
+        for (uint64_t number : listLogNumbers()) {
+            if (number != logNumber) removeLogFile(walFileName(number));
+        }
     }
 
-    void recover() {
-        std::ifstream inFile(walFileName, std::ios::in | std::ios::binary);
+    // Replays a log from before segments existed, up to its first record that does not
+    // decode; the records are numbered in file order.
+    void replayLogFile(const std::string& filename) {
+        std::ifstream inFile(filename, std::ios::in | std::ios::binary);
         if (!inFile.is_open()) return;
 
         std::vector<uint8_t> fileData((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
         inFile.close();
+        recoverLegacy(fileData);
+    }
 
+    void recoverLegacy(const Buffer& fileData) {
         size_t offset = 0;
         while (offset < fileData.size()) {
             try {
@@ -496,189 +4502,139 @@ public:
                 uint32_t valLen = decodeLength(fileData, offset);
                 std::string val = decodeBytes(fileData, offset, valLen);
 
-                insertInMemory(key, val);
+                bool deleted = val == TOMBSTONE_VALUE;
+                mem->insert(internalKey(key, ++lastSequence, deleted ? ValueType::Deletion : ValueType::Value),
+                            deleted ? std::string() : val);
             } catch (const std::exception& e) {
                 break;
             }
         }
     }
 
-    void flush() {
-        std::string sstFileName = "L0_00" + std::to_string(sstCounter) + ".sst";
-        std::ofstream sstFile(sstFileName, std::ios::out | std::ios::binary);
-        
-        if (!sstFile.is_open()) return;
-
-        std::vector<IndexEntry> currentSSTIndex;
-        
-        // Count elements for Bloom Filter
-        int numElements = 0;
-        Node* countNode = head->forward[0];
-        while(countNode) { numElements++; countNode = countNode->forward[0]; }
-        
-        BloomFilter bf(numElements > 0 ? numElements : 10);
-
-        uint64_t currentOffset = 0;
-        int entryCount = 0;         
-        int SPARSE_FACTOR = 3; 
-        
-        Node* current = head->forward[0];
-        while (current != nullptr) {
-            bf.add(current->key); 
+    // Swaps out the active memtable and waits until it (and anything already pending)
+    // is on disk as an L0 table. Returns false, without waiting, once the store has a
+    // background error, such as a flush that kept failing.
+    bool flush() {
+        Writer w;
+        w.batch = nullptr;
 
-            Buffer entry;
-            encodeLength(entry, current->key.size());
-            encodeBytes(entry, current->key);
-            encodeLength(entry, current->value.size());
-            encodeBytes(entry, current->value);
+        std::unique_lock<std::mutex> lock(writeMutex);
+        acquireWriteToken(w, lock);
+        lock.unlock();
 
-            if (entryCount % SPARSE_FACTOR == 0) {
-                currentSSTIndex.push_back({current->key, (uint32_t)currentOffset});
+        bool ok;
+        {
+            std::unique_lock<std::mutex> stateLock(mutex);
+            auto settled = [&]() { return imm == nullptr || !backgroundError.empty(); };
+            bgCv.wait(stateLock, settled);
+            if (backgroundError.empty() && !mem->empty()) {
+                switchMemTable();
+                bgCv.wait(stateLock, settled);
             }
-
-            sstFile.write(reinterpret_cast<const char*>(entry.data()), entry.size());
-            currentOffset += entry.size();
-            entryCount++;
-            current = current->forward[0];
-        }
-
-        uint64_t indexStartOffset = currentOffset; 
-        for (const auto& idx : currentSSTIndex) {
-            Buffer idxEntry;
-            encodeLength(idxEntry, idx.key.size());
-            encodeBytes(idxEntry, idx.key);
-            encodeLength(idxEntry, idx.offset); 
-            sstFile.write(reinterpret_cast<const char*>(idxEntry.data()), idxEntry.size());
-            currentOffset += idxEntry.size();
-        }
-
-        uint64_t bloomStartOffset = currentOffset;
-        Buffer bloomBuf;
-        bf.serialize(bloomBuf);
-        sstFile.write(reinterpret_cast<const char*>(bloomBuf.data()), bloomBuf.size());
-
-        Buffer footer;
-        encodeLength(footer, (uint32_t)indexStartOffset);
-        encodeLength(footer, (uint32_t)bloomStartOffset);
-        sstFile.write(reinterpret_cast<const char*>(footer.data()), footer.size());
-
-        sstFile.close();
-
-        appendToManifest(sstFileName);
-        sstables.push_back({sstFileName, currentSSTIndex, bf});
-
-        Node* wipe = head->forward[0];
-        while (wipe != nullptr) {
-            Node* next = wipe->forward[0];
-            delete wipe;
-            wipe = next;
+            ok = backgroundError.empty();
         }
-        for(int i=0; i<=MAX_LEVEL; i++) head->forward[i] = nullptr;
-        currentLevel = 0;
-        
-        walFile.close();
-        walFile.open(walFileName, std::ios::out | std::ios::trunc | std::ios::binary); 
 
-        sstCounter++;
+        lock.lock();
+        releaseWriteToken(w, 1, true);
+        return ok;
     }
 
-    
+    // Pushes everything down to the deepest non-empty level (L1 at least), one level
+    // at a time, dropping overwritten values and tombstones on the way.
     void compact() {
-        if (sstables.empty()) return;
-        std::cout << "Compacting " << sstables.size() << " SSTables..." << std::endl;
-        
-       
-        std::map<std::string, std::string> mergedData;
-        for (const auto& meta : sstables) {
-            auto fileData = readAllFromSSTable(meta);
-            for (const auto& kv : fileData) {
-                mergedData[kv.first] = kv.second;
+        int targetLevel = 1;
+        size_t fileCount = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            bgCv.wait(lock, [&]() { return !manualCompaction; });
+            manualCompaction = true;
+            bgCv.wait(lock, [&]() { return runningCompactions == 0; });
+            for (int level = 0; level < NUM_LEVELS; level++) {
+                fileCount += current->levels[level].size();
+                if (!current->levels[level].empty()) targetLevel = std::max(targetLevel, level);
             }
         }
-
-     
-        std::string newSSTName = "L1_merged.sst";
-        std::ofstream sstFile(newSSTName, std::ios::out | std::ios::binary);
-        
-        std::vector<IndexEntry> newIndex;
-        
-        
-        int validElements = 0;
-        for (const auto& kv : mergedData) {
-            if (kv.second != TOMBSTONE_VALUE) validElements++;
+        if (fileCount == 0) {
+            finishManualCompaction();
+            return;
         }
-        BloomFilter bf(validElements > 0 ? validElements : 10);
-
-        uint64_t currentOffset = 0;
-        int entryCount = 0;
-        int SPARSE_FACTOR = 3;
-
-        for (const auto& kv : mergedData) {
-            
-            if (kv.second == TOMBSTONE_VALUE) {
-                continue; 
+        for (int level = 0; level < targetLevel; level++) {
+            Compaction c;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!backgroundError.empty()) break;
+                if (current->levels[level].empty()) continue;
+                c.level = level;
+                c.inputs[0] = current->levels[level];
+                setupOtherInputs(c);
             }
+            runCompaction(c, false);
+        }
+        finishManualCompaction();
+    }
 
-            bf.add(kv.first);
-
-            Buffer entry;
-            encodeLength(entry, kv.first.size());
-            encodeBytes(entry, kv.first);
-            encodeLength(entry, kv.second.size());
-            encodeBytes(entry, kv.second);
+    void finishManualCompaction() {
+        std::lock_guard<std::mutex> lock(mutex);
+        manualCompaction = false;
+        bgCv.notify_all();
+        compactionCv.notify_all();
+    }
 
-            if (entryCount % SPARSE_FACTOR == 0) {
-                newIndex.push_back({kv.first, (uint32_t)currentOffset});
+    // Blocks until the background threads are idle: imm flushed, no compaction running
+    // and no level due for one. Returns false if a background error stopped them first.
+    bool waitForCompactions() {
+        std::unique_lock<std::mutex> lock(mutex);
+        bgCv.wait(lock, [&]() {
+            if (!backgroundError.empty()) return true;
+            if (imm || manualCompaction || runningCompactions > 0) return false;
+            for (int level = 0; level < NUM_LEVELS - 1; level++) {
+                if (levelScore(level) >= 1) return false;
             }
+            return true;
+        });
+        return backgroundError.empty();
+    }
 
-            sstFile.write(reinterpret_cast<const char*>(entry.data()), entry.size());
-            currentOffset += entry.size();
-            entryCount++;
-        }
-
-        // Write Index
-        uint64_t indexStart = currentOffset;
-        for (const auto& idx : newIndex) {
-            Buffer idxEntry;
-            encodeLength(idxEntry, idx.key.size());
-            encodeBytes(idxEntry, idx.key);
-            encodeLength(idxEntry, idx.offset);
-            sstFile.write(reinterpret_cast<const char*>(idxEntry.data()), idxEntry.size());
-            currentOffset += idxEntry.size();
-        }
+    int numFilesAtLevel(int level) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return static_cast<int>(current->levels[level].size());
+    }
 
-        // Write Bloom
-        uint64_t bloomStart = currentOffset;
-        Buffer bloomBuf;
-        bf.serialize(bloomBuf);
-        sstFile.write(reinterpret_cast<const char*>(bloomBuf.data()), bloomBuf.size());
+    const std::shared_ptr<BlockCache>& getBlockCache() const { return blockCache; }
 
-        // Write Footer
-        Buffer footer;
-        encodeLength(footer, (uint32_t)indexStart);
-        encodeLength(footer, (uint32_t)bloomStart);
-        sstFile.write(reinterpret_cast<const char*>(footer.data()), footer.size());
-        sstFile.close();
+    // Why writes are being refused, or "" while the store is healthy.
+    std::string getBackgroundError() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return backgroundError;
+    }
 
-        // 3. Cleanup Old Files
-        for (const auto& meta : sstables) {
-            std::filesystem::remove(meta.filename);
+    // Checks every block of the live tables against its checksum, reading past the
+    // block cache, and returns how many failed. v1 tables have none to check.
+    uint64_t scrub() {
+        std::shared_ptr<const SuperVersion> sv = acquireSuperVersion();
+        uint64_t failures = 0;
+        for (const auto& level : sv->version->levels) {
+            for (const auto& meta : level) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (shuttingDown) return failures;
+                }
+                failures += scrubTable(*meta);
+            }
         }
-        
-        // 4. Update Metadata
-        sstables.clear();
-        std::ofstream manifest(manifestFileName, std::ios::trunc);
-        manifest << newSSTName << "\n";
-        manifest.close();
-
-        loadSSTableMeta(newSSTName);
+        return failures;
     }
 
+    // Blocks that have failed their checksum so far, on reads and in scrubs.
+    uint64_t checksumMismatches() const { return checksumFailures.load(); }
+
     void displayList() {
-        Node* node = head->forward[0]; 
+        std::lock_guard<std::mutex> lock(mutex);
+        const Node* node = mem->first(); 
         while (node != nullptr) {
-            std::cout << node->key << " : " << node->value << '\n';
-            node = node->forward[0];
+            bool deleted = keyType(node->key()) == ValueType::Deletion;
+            std::cout << decodeUserKey(encodedUserKey(node->key())) << " : " << (deleted ? TOMBSTONE_VALUE : node->value()) << '\n';
+            node = node->next(0);
         }
     }
 };
@@ -25,10 +25,8 @@ void runCrashTest() {
 
 void runRecoveryTest() {
     std::cout << "--- [TEST] Phase 2: Recovering & Verifying ---\n";
+    // Opening the store replays whatever the crashed process left in its logs.
     KVStore db;
-    
-    
-    db.recover();
 
    
     int foundCount = 0;
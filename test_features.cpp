@@ -0,0 +1,1753 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <filesystem>
+#include <csignal>
+#include <sys/resource.h>
+#include "kvstore.h"
+
+// Feature checks, one scratch directory each. Run all of them, or one by name.
+
+int failures = 0;
+
+void check(const std::string& what, bool ok) {
+    std::cout << (ok ? "  ✅ " : "  ❌ ") << what << "\n";
+    if (!ok) failures++;
+}
+
+// Runs fn inside a fresh scratch directory, since KVStore keeps its files in the cwd.
+void inScratchDir(const std::string& name, const std::function<void()>& fn) {
+    auto home = std::filesystem::current_path();
+    std::filesystem::remove_all(name);
+    std::filesystem::create_directory(name);
+    std::filesystem::current_path(name);
+    fn();
+    std::filesystem::current_path(home);
+    std::filesystem::remove_all(name);
+}
+
+// Caps the size of files this process writes until destroyed; writes past it fail
+// with EFBIG instead of raising SIGXFSZ. stdout may be a file too, so it is flushed
+// first and its error state cleared after.
+class FileSizeLimit {
+    rlimit saved;
+
+public:
+    explicit FileSizeLimit(rlim_t bytes) {
+        std::cout.flush();
+        signal(SIGXFSZ, SIG_IGN);
+        getrlimit(RLIMIT_FSIZE, &saved);
+        rlimit limit{bytes, saved.rlim_max};
+        setrlimit(RLIMIT_FSIZE, &limit);
+    }
+    ~FileSizeLimit() {
+        setrlimit(RLIMIT_FSIZE, &saved);
+        std::cout.clear();
+    }
+};
+
+// --- WAL ---
+
+void testWalOpenFailure() {
+    std::cout << "--- [TEST] Writes fail when the WAL cannot be opened ---\n";
+    inScratchDir("test_wal_open", []() {
+        {
+            FileSizeLimit limit(0);
+            KVStore db;
+            check("put() is refused", !db.put("key", "value"));
+            check("the reason is reported", !db.getBackgroundError().empty());
+            check("the refused write is not visible", db.get("key").empty());
+
+            WALWriter wal;
+            check("a log whose header cannot be written is not left open",
+                  !wal.open("wal_check.log", true, WalSyncMode::NoSync, 100) && !wal.isOpen());
+        }
+        KVStore db;
+        check("a reopened store takes writes again", db.put("key", "value") && db.get("key") == "value");
+    });
+}
+
+void testFlushFailure() {
+    std::cout << "--- [TEST] A flush that keeps failing stops the store ---\n";
+    inScratchDir("test_flush_failure", []() {
+        {
+            KVStore db;
+            db.put("key", "value");
+            // Every manifest write now fails, so no flush can be installed.
+            std::filesystem::create_directory("MANIFEST.tmp");
+            check("flush() gives up and returns false", !db.flush());
+            check("the reason is reported", !db.getBackgroundError().empty());
+            check("later writes are refused", !db.put("other", "value"));
+            check("the unflushed write is still readable", db.get("key") == "value");
+        }
+        std::filesystem::remove("MANIFEST.tmp");
+        KVStore db;
+        check("recovery replays the unflushed write", db.get("key") == "value");
+    });
+}
+
+// Counts the wal_NNNNNN.log files in the cwd.
+int countLogs() {
+    int logs = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        logs += entry.path().filename().string().rfind("wal_", 0) == 0;
+    }
+    return logs;
+}
+
+void testRecoveryFallback() {
+    std::cout << "--- [TEST] Records recovery could only keep in memory are not replayed twice ---\n";
+    inScratchDir("test_recovery_fallback", []() {
+        {
+            KVStore db;
+            db.put("key", "old");
+        }
+        {
+            // Recovery cannot install its tables, so it serves the log from memory.
+            std::filesystem::create_directory("MANIFEST.tmp");
+            KVStore db;
+            check("the recovered write is readable", db.get("key") == "old");
+            check("the old log is replaced by the new segment", countLogs() == 1);
+            std::filesystem::remove("MANIFEST.tmp");
+            db.put("key", "new");
+            check("a later flush succeeds", db.flush());
+        }
+        KVStore db;
+        check("reopening keeps the newer value", db.get("key") == "new");
+    });
+}
+
+// The newest wal_NNNNNN.log in the cwd.
+std::string newestLog() {
+    std::string newest;
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("wal_", 0) == 0 && name > newest) newest = name;
+    }
+    return newest;
+}
+
+// Writes two batches and closes the store with both only in the log, cutting
+// tearBytes off the end of the log (the second batch's record) if not 0.
+void writeTwoBatches(size_t tearBytes) {
+    {
+        KVStore db;
+        WriteBatch first;
+        for (int i = 0; i < 10; i++) first.put("a" + std::to_string(i), "first");
+        db.write(first);
+        WriteBatch second;
+        for (int i = 0; i < 10; i++) second.put("b" + std::to_string(i), "second");
+        second.del("a0");
+        db.write(second);
+    }
+    if (tearBytes > 0) {
+        std::string log = newestLog();
+        std::filesystem::resize_file(log, std::filesystem::file_size(log) - tearBytes);
+    }
+}
+
+// Writes keys k0..k99, one WAL record each, and closes the store with all of them
+// only in its log. Returns the offset of each record in that log.
+std::vector<size_t> writeHundredRecords() {
+    {
+        KVStore db;
+        for (int i = 0; i < 100; i++) db.put("k" + std::to_string(i), "value");
+    }
+    std::ifstream in(newestLog(), std::ios::binary);
+    Buffer data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<size_t> offsets;
+    for (size_t offset = WAL_HEADER_SIZE; offset + WAL_RECORD_HEADER_SIZE <= data.size();) {
+        offsets.push_back(offset);
+        offset += WAL_RECORD_HEADER_SIZE + getFixed32(data.data() + offset);
+    }
+    return offsets;
+}
+
+void overwriteLog(size_t offset, const std::string& bytes) {
+    std::fstream log(newestLog(), std::ios::in | std::ios::out | std::ios::binary);
+    log.seekp(offset);
+    log.write(bytes.data(), bytes.size());
+}
+
+int countKeys(KVStore& db) {
+    int found = 0;
+    for (int i = 0; i < 100; i++) found += !db.get("k" + std::to_string(i)).empty();
+    return found;
+}
+
+void testWalCorruption() {
+    std::cout << "--- [TEST] A damaged record length is corruption, not a torn tail ---\n";
+    for (auto mode : {WalRecoveryMode::PointInTime, WalRecoveryMode::TolerateTornTail}) {
+        bool pointInTime = mode == WalRecoveryMode::PointInTime;
+        std::string name = pointInTime ? "PointInTime" : "TolerateTornTail";
+        Options options;
+        options.walRecoveryMode = mode;
+
+        // Record 11's length made to run past the end of the log, then to cut it short.
+        for (auto [byte, value] : {std::pair<size_t, char>{3, 0x7F}, {0, 0x01}}) {
+            inScratchDir("test_wal_length", [&]() {
+                overwriteLog(writeHundredRecords()[10] + byte, std::string(1, value));
+                if (pointInTime) {
+                    KVStore db(options);
+                    check(name + ": the log is kept up to the damaged record", countKeys(db) == 10);
+                } else {
+                    bool threw = false;
+                    try {
+                        KVStore db(options);
+                    } catch (const std::runtime_error&) {
+                        threw = true;
+                    }
+                    check(name + ": the open fails", threw);
+                }
+            });
+        }
+
+        inScratchDir("test_wal_torn", [&]() {
+            writeHundredRecords();
+            std::string log = newestLog();
+            std::filesystem::resize_file(log, std::filesystem::file_size(log) - 3);
+            KVStore db(options);
+            check(name + ": a write cut off at the end is dropped", countKeys(db) == 99);
+        });
+        inScratchDir("test_wal_zero_tail", [&]() {
+            size_t last = writeHundredRecords().back();
+            std::string log = newestLog();
+            // Cut inside the last header, then extended with zeros.
+            std::filesystem::resize_file(log, last + 5);
+            std::filesystem::resize_file(log, last + 4096);
+            KVStore db(options);
+            check(name + ": a cut-off write followed by zeros is dropped", countKeys(db) == 99);
+        });
+    }
+}
+
+void testBatchReplay() {
+    std::cout << "--- [TEST] WriteBatch replay is all or nothing ---\n";
+    auto count = [](KVStore& db, const std::string& prefix) {
+        int found = 0;
+        for (int i = 0; i < 10; i++) found += !db.get(prefix + std::to_string(i)).empty();
+        return found;
+    };
+    inScratchDir("test_batch_replay", [&]() {
+        writeTwoBatches(0);
+        KVStore db;
+        check("both batches replay whole", count(db, "a") == 9 && count(db, "b") == 10);
+    });
+    inScratchDir("test_batch_torn", [&]() {
+        writeTwoBatches(3);
+        KVStore db;
+        check("the batch before a torn one replays whole", count(db, "a") == 10);
+        check("none of the torn batch replays, its delete included", count(db, "b") == 0);
+    });
+}
+
+// --- Keys and snapshots ---
+
+void testNulKeys() {
+    std::cout << "--- [TEST] Keys with embedded NUL bytes round-trip ---\n";
+    inScratchDir("test_nul_keys", []() {
+        KVStore db;
+        const std::string nulKeys[] = {std::string("bin:\0", 5), std::string("bin:\0\0x", 7), std::string("bin:a\0b", 7)};
+        for (const auto& key : nulKeys) db.put(key, "nul");
+        db.put("bin:", "plain");
+        db.flush();
+
+        bool found = true;
+        for (const auto& key : nulKeys) found &= db.get(key) == "nul";
+        check("get() finds every key from its table", found);
+
+        ReadOptions binOnly;
+        binOnly.prefix = "bin:";
+        auto it = db.newIterator(binOnly);
+        std::vector<std::string> scanned;
+        for (it->seekToFirst(); it->valid(); it->next()) scanned.push_back(std::string(it->key()));
+        std::vector<std::string> expected(std::begin(nulKeys), std::end(nulKeys));
+        expected.push_back("bin:");
+        std::sort(expected.begin(), expected.end());
+        check("a scan returns the keys intact and in order", scanned == expected);
+    });
+}
+
+// Bytes of all the tables in the cwd.
+uint64_t tableBytes() {
+    uint64_t bytes = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        if (entry.path().extension() == ".sst") bytes += entry.file_size();
+    }
+    return bytes;
+}
+
+void testSnapshots() {
+    std::cout << "--- [TEST] Snapshots ---\n";
+    inScratchDir("test_snapshots", []() {
+        KVStore db;
+        db.put("a", "a1");
+        db.put("b", "b1");
+        ReadOptions atSnapshot;
+        atSnapshot.snapshot = db.getSnapshot();
+        db.put("a", "a2");
+        db.del("b");
+        db.put("c", "c2");
+
+        auto scan = [&](const ReadOptions& readOptions) {
+            std::string seen;
+            auto it = db.newIterator(readOptions);
+            for (it->seekToFirst(); it->valid(); it->next()) seen += std::string(it->key()) + "=" + std::string(it->value()) + " ";
+            return seen;
+        };
+        auto readsAsOfSnapshot = [&]() {
+            return db.get(atSnapshot, "a") == "a1" && db.get(atSnapshot, "b") == "b1" &&
+                   db.get(atSnapshot, "c").empty() && scan(atSnapshot) == "a=a1 b=b1 ";
+        };
+        check("reads at the snapshot see the store as it was", readsAsOfSnapshot());
+        check("reads without one see the latest writes",
+              db.get("a") == "a2" && db.get("b").empty() && scan(ReadOptions()) == "a=a2 c=c2 ");
+
+        db.flush();
+        check("the snapshot's versions survive a flush", readsAsOfSnapshot());
+        db.compact();
+        check("and a compaction", readsAsOfSnapshot());
+        db.releaseSnapshot(atSnapshot.snapshot);
+        check("the latest state is unchanged", scan(ReadOptions()) == "a=a2 c=c2 ");
+    });
+    inScratchDir("test_snapshot_release", []() {
+        Options options;
+        options.compression = CompressionType::None;
+        KVStore db(options);
+        std::mt19937 random(42);
+        auto fill = [&](const std::string& tag) {
+            for (int i = 0; i < 200; i++) {
+                std::string value(1024, '\0');
+                for (char& c : value) c = static_cast<char>(random());
+                db.put("key" + std::to_string(1000 + i), tag + value);
+            }
+        };
+        fill("old");
+        const Snapshot* snapshot = db.getSnapshot();
+        fill("new");
+        db.flush();
+        db.compact();
+        uint64_t pinned = tableBytes();
+        ReadOptions atSnapshot;
+        atSnapshot.snapshot = snapshot;
+        check("a compaction keeps the versions a snapshot needs",
+              db.get(atSnapshot, "key1000").rfind("old", 0) == 0 && db.get("key1000").rfind("new", 0) == 0);
+
+        db.releaseSnapshot(snapshot);
+        // New versions of the first and last key make the next compaction rewrite every table.
+        db.put("key1000", "newest");
+        db.put("key1199", "newest");
+        db.flush();
+        db.compact();
+        uint64_t released = tableBytes();
+        check("once released, compaction drops them (" + std::to_string(pinned) + " -> " +
+                  std::to_string(released) + " bytes)", released < pinned * 6 / 10);
+        check("the latest versions remain", db.get("key1000") == "newest" && db.get("key1100").rfind("new", 0) == 0);
+    });
+}
+
+// --- Filters ---
+
+void testBloomFilter() {
+    std::cout << "--- [TEST] The blocked Bloom filter has no false negatives and its predicted false-positive rate ---\n";
+    for (int bitsPerKey : {4, 6, 10}) {
+        const int keys = 10000, misses = 100000;
+        BloomFilter filter(keys, bitsPerKey);
+        for (int i = 0; i < keys; i++) filter.add("key" + std::to_string(i));
+        Buffer serialized;
+        filter.serialize(serialized);
+
+        bool noFalseNegatives = true, agree = true;
+        for (int i = 0; i < keys; i++) {
+            std::string key = "key" + std::to_string(i);
+            noFalseNegatives &= filter.possiblyContains(key);
+            agree &= BloomFilter::probeSerialized(asView(serialized), BloomFilter::hashKey(key));
+        }
+        int falsePositives = 0;
+        for (int i = 0; i < misses; i++) {
+            uint64_t hash = BloomFilter::hashKey("miss" + std::to_string(i));
+            bool hit = filter.possiblyContainsHash(hash);
+            falsePositives += hit;
+            agree &= BloomFilter::probeSerialized(asView(serialized), hash) == hit;
+        }
+
+        // A standard Bloom filter's rate (1 - e^(-k/b))^k, averaged over the Poisson
+        // number of keys that share a key's 512-bit block.
+        int probes = std::clamp(static_cast<int>(bitsPerKey * 0.69 + 0.5), 1, 16);
+        double mean = 512.0 / bitsPerKey, load = std::exp(-mean), predicted = 0;
+        for (int n = 0; n < 400; n++) {
+            if (n > 0) load *= mean / n;
+            predicted += load * std::pow(1 - std::pow(1 - 1 / 512.0, probes * n), probes);
+        }
+        double rate = static_cast<double>(falsePositives) / misses;
+        std::string label = std::to_string(bitsPerKey) + " bits per key: ";
+        check(label + "every added key passes", noFalseNegatives);
+        check(label + "false positives " + std::to_string(rate) + " against " + std::to_string(predicted) +
+                  " predicted",
+              rate > predicted / 1.5 && rate < predicted * 1.5);
+        check(label + "probeSerialized() agrees with possiblyContains()", agree);
+    }
+}
+
+// --- Iterators ---
+
+using Model = std::map<std::string, std::string>;
+
+// Checks a store iterator against the part of model in [lower, upper) (empty for no
+// bound): full scans both ways, then seeks each followed by a random walk that keeps
+// switching between next() and prev(). Returns a description of the first mismatch.
+std::string compareIterator(Iterator& it, const Model& model, const std::string& lower,
+                            const std::string& upper, std::mt19937& random) {
+    auto first = lower.empty() ? model.begin() : model.lower_bound(lower);
+    auto last = upper.empty() ? model.end() : model.lower_bound(upper);
+    auto at = [&](Model::const_iterator pos) {
+        if (pos == last) return !it.valid() ? std::string() : "extra key " + std::string(it.key());
+        if (!it.valid()) return "missing key " + pos->first;
+        if (it.key() != pos->first || it.value() != pos->second) {
+            return "got " + std::string(it.key()) + " instead of " + pos->first;
+        }
+        return std::string();
+    };
+
+    std::string error;
+    auto pos = first;
+    for (it.seekToFirst(); error.empty() && pos != last; it.next(), ++pos) error = at(pos);
+    if (error.empty()) error = at(last);
+    if (!error.empty()) return "forward scan: " + error;
+
+    pos = last;
+    it.seekToLast();
+    while (error.empty() && pos != first) {
+        error = at(--pos);
+        it.prev();
+    }
+    if (error.empty() && it.valid()) error = "extra key " + std::string(it.key());
+    if (!error.empty()) return "backward scan: " + error;
+
+    for (int s = 0; s < 200 && error.empty(); s++) {
+        // Present keys, absent ones and keys between any two.
+        std::string target = "k" + std::to_string(1000 + random() % 320) + (random() % 3 == 0 ? "x" : "");
+        std::string from = !lower.empty() && target < lower ? lower : target;
+        pos = model.lower_bound(from);
+        if (pos == model.end() || (!upper.empty() && pos->first >= upper)) pos = last;
+        it.seek(target);
+        error = at(pos);
+        for (int step = 0; step < 20 && error.empty() && pos != last; step++) {
+            if (random() % 2) {
+                ++pos;
+                it.next();
+            } else if (pos != first) {
+                --pos;
+                it.prev();
+            } else {
+                break;
+            }
+            error = at(pos);
+        }
+        if (!error.empty()) error = "after seek(" + target + "): " + error;
+    }
+    if (error.empty() && !it.ok()) error = "iterator reports an error";
+    return error;
+}
+
+// Reads through pread, or through the mapping with mmap.
+std::string readPath(bool mmap) { return mmap ? " (mmap reads)" : ""; }
+
+void testIteratorModel(bool mmap) {
+    std::cout << "--- [TEST] Iterators match an ordered model across memtables and levels" << readPath(mmap) << " ---\n";
+    inScratchDir("test_iterator_model", [&]() {
+        Options options;
+        options.useMmapReads = mmap;
+        options.memtableSize = 16 * 1024;
+        options.level0CompactionTrigger = 100;
+        options.level0SlowdownTrigger = 100;
+        options.level0StopTrigger = 100;
+        options.blockSize = 512;
+        options.indexPartitionSize = 256;
+        KVStore db(options);
+        Model model;
+        std::mt19937 random(7);
+
+        // Keys k1000..k1299; a third of the operations are deletes.
+        auto randomOps = [&](int ops) {
+            for (int i = 0; i < ops; i++) {
+                std::string key = "k" + std::to_string(1000 + random() % 300);
+                bool ok;
+                if (random() % 3 == 0) {
+                    ok = db.del(key);
+                    if (ok) model.erase(key);
+                } else {
+                    std::string value = key + "." + std::to_string(i) + std::string(random() % 40, 'v');
+                    ok = db.put(key, value);
+                    if (ok) model[key] = value;
+                }
+                if (!ok) return false;
+            }
+            return true;
+        };
+
+        randomOps(3000);
+        db.flush();
+        db.compact(); // L1 and below
+        const Snapshot* snapshot = db.getSnapshot();
+        Model snapshotModel = model;
+
+        randomOps(600);
+        // A run of tombstones for next() and prev() to step over.
+        for (int i = 1100; i < 1150; i++) {
+            db.del("k" + std::to_string(i));
+            model.erase("k" + std::to_string(i));
+        }
+        db.flush(); // L0
+
+        // With manifest writes failing no flush can finish, so a full memtable stays
+        // behind as imm and the writes after it stay in mem until writes are refused.
+        std::filesystem::create_directory("MANIFEST.tmp");
+        check("writes stop once a memtable cannot be flushed", !randomOps(100000));
+
+        std::vector<std::pair<std::string, std::string>> bounds = {
+            {"", ""}, {"k1050", "k1250"}, {"k1100", "k1150"}, {"k1149x", ""}, {"", "k1001"}};
+        for (bool atSnapshot : {false, true}) {
+            for (const auto& [lower, upper] : bounds) {
+                ReadOptions readOptions;
+                readOptions.snapshot = atSnapshot ? snapshot : nullptr;
+                readOptions.lowerBound = lower;
+                readOptions.upperBound = upper;
+                auto it = db.newIterator(readOptions);
+                std::string error = compareIterator(*it, atSnapshot ? snapshotModel : model, lower, upper, random);
+                check(std::string(atSnapshot ? "snapshot" : "latest") + " [" + lower + ", " + upper + ")" +
+                          (error.empty() ? "" : ": " + error),
+                      error.empty());
+            }
+        }
+
+        ReadOptions prefixOnly;
+        prefixOnly.prefix = "k112";
+        auto it = db.newIterator(prefixOnly);
+        std::string error = compareIterator(*it, model, "k112", "k113", random);
+        check("prefix k112" + (error.empty() ? "" : ": " + error), error.empty());
+        db.releaseSnapshot(snapshot);
+    });
+}
+
+// --- Compression ---
+
+void testLzRoundTrip() {
+    std::cout << "--- [TEST] LZFast and LZStrong round-trip any input ---\n";
+    std::mt19937 random(5);
+    auto randomBytes = [&](size_t n) {
+        std::string bytes(n, '\0');
+        for (auto& c : bytes) c = static_cast<char>(random());
+        return bytes;
+    };
+    auto repeated = [](const std::string& unit, size_t n) {
+        std::string bytes;
+        while (bytes.size() < n) bytes += unit;
+        bytes.resize(n);
+        return bytes;
+    };
+    // A random unit repeated at the given period: the only matches sit exactly that far back.
+    auto periodic = [&](size_t period, size_t n) { return repeated(randomBytes(period), n); };
+
+    std::vector<std::pair<std::string, std::string>> inputs = {
+        {"empty", ""},
+        {"one byte", "x"},
+        {"shorter than a match", "abc"},
+        {"incompressible, 4 KiB", randomBytes(4096)},
+        {"incompressible, 100 KiB", randomBytes(100 * 1024)},
+        {"one repeated byte, 1 MiB", std::string(1024 * 1024, 'a')},
+        {"a short repeated phrase", repeated("key0001=value;", 200 * 1024)},
+        {"period at the longest offset", periodic(LZ_MAX_OFFSET, 3 * LZ_MAX_OFFSET)},
+        {"period one past the longest offset", periodic(LZ_MAX_OFFSET + 1, 3 * LZ_MAX_OFFSET)},
+        {"64 KiB less one", repeated("0123456789", 64 * 1024 - 1)},
+        {"64 KiB", repeated("0123456789", 64 * 1024)},
+        {"64 KiB and one", repeated("0123456789", 64 * 1024 + 1)},
+        {"literals, then a run, then literals",
+         randomBytes(70 * 1024) + std::string(70 * 1024, 'z') + randomBytes(70 * 1024)},
+    };
+
+    for (auto type : {CompressionType::LZFast, CompressionType::LZStrong}) {
+        std::string codec = type == CompressionType::LZFast ? "LZFast" : "LZStrong";
+        // Every input in turn on one thread, so each reuses the match tables the previous
+        // ones left behind.
+        for (const auto& [name, input] : inputs) {
+            Buffer compressed, output;
+            lzCompress(input, compressed, type == CompressionType::LZStrong);
+            bool ok = uncompressBlock(asView(compressed), type, output) && asView(output) == input;
+            check(codec + ": " + name + " (" + std::to_string(input.size()) + " -> " +
+                      std::to_string(compressed.size()) + " bytes)",
+                  ok);
+        }
+
+        Buffer raw(64 * 1024, 'a'), compressed;
+        check(codec + ": a repetitive block is stored compressed", compressBlock(raw, type, compressed) == type);
+        std::string noise = randomBytes(4096);
+        raw.assign(noise.begin(), noise.end());
+        check(codec + ": an incompressible block is stored raw",
+              compressBlock(raw, type, compressed) == CompressionType::None);
+
+        // A stream cut short anywhere fails cleanly instead of returning garbage. The input
+        // ends in literals, so even dropping just the last byte loses data.
+        std::string input = repeated("key0001=value;", 4096) + randomBytes(512);
+        compressed.clear();
+        lzCompress(input, compressed, type == CompressionType::LZStrong);
+        bool rejected = true;
+        for (size_t cut = 0; cut < compressed.size(); cut++) {
+            Buffer output;
+            std::string_view truncated(reinterpret_cast<const char*>(compressed.data()), cut);
+            rejected &= !uncompressBlock(truncated, type, output);
+        }
+        check(codec + ": every truncated stream is rejected", rejected);
+    }
+}
+
+// --- Checksums ---
+
+// Leaves "key10000" at "old" in L1 and "fresh:key10000" above it in an uncompressed L0
+// table, then flips one byte of the fresh value on disk.
+void writeCorruptTable() {
+    Options options;
+    options.compression = CompressionType::None;
+    KVStore db(options);
+    db.put("key10000", "old");
+    db.flush();
+    db.compact();
+    for (int i = 0; i < 2000; i++) {
+        std::string key = "key" + std::to_string(10000 + i);
+        db.put(key, "fresh:" + key);
+    }
+    db.flush();
+
+    std::string table;
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("L0_", 0) == 0) table = name;
+    }
+    std::fstream file(table, std::ios::in | std::ios::out | std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size_t pos = data.find("fresh:key10000");
+    file.seekp(pos);
+    file.put('F');
+}
+
+// Flips the bits of the byte at offset in path.
+void flipByte(const std::string& path, uint64_t offset) {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(offset);
+    char byte = static_cast<char>(file.get() ^ 0xFF);
+    file.seekp(offset);
+    file.put(byte);
+}
+
+// The one .sst file in the cwd.
+std::string onlyTable() {
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        if (entry.path().extension() == ".sst") return entry.path().filename().string();
+    }
+    return "";
+}
+
+// The table's footer, read the way the store does.
+SSTableFooter tableFooter(const std::string& path) {
+    SSTableFooter footer;
+    auto file = RandomAccessFile::open(path, false);
+    if (file) readFooter(*file, footer);
+    return footer;
+}
+
+void testChecksums(bool mmap) {
+    std::cout << "--- [TEST] A flipped block byte is caught as each ChecksumMode promises" << readPath(mmap) << " ---\n";
+    auto open = [&](ChecksumMode mode) {
+        Options options;
+        options.compression = CompressionType::None;
+        options.checksumMode = mode;
+        options.useMmapReads = mmap;
+        return std::make_unique<KVStore>(options);
+    };
+    auto getThrows = [](KVStore& db) {
+        try {
+            db.get("key10000");
+        } catch (const CorruptionError&) {
+            return true;
+        }
+        return false;
+    };
+    auto scanOk = [](KVStore& db) {
+        auto it = db.newIterator();
+        for (it->seekToFirst(); it->valid(); it->next()) {
+        }
+        return it->ok();
+    };
+
+    inScratchDir("test_checksums_always", [&]() {
+        writeCorruptTable();
+        auto db = open(ChecksumMode::Always);
+        check("Always: get() throws CorruptionError instead of returning the older value", getThrows(*db));
+        check("Always: and again once the store has seen the block", getThrows(*db));
+        check("Always: the mismatch is counted", db->checksumMismatches() >= 1);
+        check("Always: a scan stops with ok() false", !scanOk(*db));
+        check("Always: scrub() finds the block", db->scrub() >= 1);
+    });
+
+    inScratchDir("test_checksums_never", [&]() {
+        writeCorruptTable();
+        auto db = open(ChecksumMode::Never);
+        check("Never: get() returns the damaged value unchecked", db->get("key10000") == "Fresh:key10000");
+        check("Never: a scan runs to the end", scanOk(*db));
+        check("Never: nothing is counted by reads", db->checksumMismatches() == 0);
+        check("Never: scrub() still finds the block", db->scrub() >= 1);
+    });
+
+    inScratchDir("test_checksums_compaction_only", [&]() {
+        writeCorruptTable();
+        auto db = open(ChecksumMode::CompactionOnly);
+        // The lookup caches the block unchecked; compaction must not trust that copy.
+        check("CompactionOnly: get() returns the damaged value", db->get("key10000") == "Fresh:key10000");
+        check("CompactionOnly: a scan runs to the end", scanOk(*db));
+        db->compact();
+        check("CompactionOnly: compact() stops with a background error", !db->getBackgroundError().empty());
+        check("CompactionOnly: the damaged table is not rewritten under a fresh checksum", db->scrub() >= 1);
+    });
+
+    // The top-level index and prefix filter are read once, at open, whatever the mode.
+    auto writeOneTable = []() {
+        Options options;
+        options.prefixBloomLength = 4;
+        KVStore db(options);
+        for (int i = 0; i < 5000; i++) db.put("key" + std::to_string(10000 + i), std::string(100, 'v'));
+        db.flush();
+    };
+    auto openThrows = [&](ChecksumMode mode) {
+        Options options;
+        options.checksumMode = mode;
+        options.useMmapReads = mmap;
+        try {
+            KVStore db(options);
+        } catch (const CorruptionError&) {
+            return true;
+        }
+        return false;
+    };
+    for (bool index : {true, false}) {
+        std::string part = index ? "top-level index" : "prefix filter";
+        inScratchDir("test_checksums_top_level", [&]() {
+            writeOneTable();
+            SSTableFooter footer = tableFooter(onlyTable());
+            flipByte(onlyTable(), (index ? footer.indexOffset : footer.bloomOffset) + 2);
+            bool all = true;
+            for (ChecksumMode mode : {ChecksumMode::Always, ChecksumMode::CompactionOnly, ChecksumMode::Never}) {
+                all &= openThrows(mode);
+            }
+            check("a damaged " + part + " fails the open with CorruptionError in every mode", all);
+        });
+    }
+    inScratchDir("test_checksums_top_level_scrub", [&]() {
+        writeOneTable();
+        Options options;
+        options.useMmapReads = mmap;
+        KVStore db(options);
+        check("a table opens cleanly and scrubs clean", db.scrub() == 0);
+        SSTableFooter footer = tableFooter(onlyTable());
+        flipByte(onlyTable(), footer.indexOffset + 2);
+        check("scrub() finds a top-level index damaged after the open", db.scrub() >= 1);
+    });
+}
+
+void testSSTableFooter() {
+    std::cout << "--- [TEST] The 28-byte footer holds 64-bit offsets and a damaged one is rejected ---\n";
+    inScratchDir("test_sstable_footer", []() {
+        {
+            // Past 4 GiB, in a sparse file, so the offsets need their high words.
+            const uint64_t base = 5ull << 30;
+            Buffer footer;
+            encodeFooter(footer, base - 200, base - 100);
+            {
+                std::ofstream out("big.sst", std::ios::binary);
+                out.seekp(static_cast<std::streamoff>(base));
+                out.write(reinterpret_cast<const char*>(footer.data()), footer.size());
+            }
+            SSTableFooter read = tableFooter("big.sst");
+            check("offsets past 4 GiB read back whole",
+                  read.version == SSTABLE_FORMAT_V2 && read.size == SSTABLE_FOOTER_V2_SIZE &&
+                      read.indexOffset == base - 200 && read.bloomOffset == base - 100);
+            std::filesystem::remove("big.sst");
+        }
+
+        {
+            KVStore db;
+            for (int i = 0; i < 5000; i++) db.put("key" + std::to_string(10000 + i), std::string(100, 'v'));
+            db.flush();
+        }
+        std::string table = onlyTable();
+        std::filesystem::copy_file(table, "table.bak");
+        uint64_t size = std::filesystem::file_size(table);
+        SSTableFooter footer = tableFooter(table);
+        check("a new table ends in a 28-byte v2 footer",
+              footer.version == SSTABLE_FORMAT_V2 && footer.size == 28 && footer.indexOffset < footer.bloomOffset &&
+                  footer.bloomOffset < size - 28);
+
+        bool truncations = true;
+        for (uint64_t cut = 1; cut <= 28; cut++) {
+            std::filesystem::copy_file("table.bak", "cut.sst", std::filesystem::copy_options::overwrite_existing);
+            std::filesystem::resize_file("cut.sst", size - cut);
+            auto file = RandomAccessFile::open("cut.sst", false);
+            SSTableFooter cutFooter;
+            truncations &= !readFooter(*file, cutFooter);
+        }
+        std::filesystem::remove("cut.sst");
+        check("readFooter() rejects the table cut short by any 1 to 28 bytes", truncations);
+
+        bool flips = true;
+        for (uint64_t offset = size - 28; offset < size; offset++) {
+            std::filesystem::copy_file("table.bak", table, std::filesystem::copy_options::overwrite_existing);
+            flipByte(table, offset);
+            try {
+                KVStore db;
+                flips = false;
+            } catch (const CorruptionError&) {
+            }
+        }
+        check("a flip of any footer byte fails the open with CorruptionError", flips);
+    });
+}
+
+// --- Compaction ---
+
+struct ManifestTable {
+    uint32_t level;
+    std::string name;
+    std::string smallest; // encoded user keys
+    std::string largest;
+    uint64_t size;
+};
+
+// The tables the MANIFEST in the cwd lists, in file order.
+std::vector<ManifestTable> readManifest() {
+    std::ifstream in("MANIFEST", std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::string_view view(data.data(), data.size() - 4);
+    size_t offset = 8;
+    decodeVarint64(view, offset);
+    decodeVarint64(view, offset);
+    std::vector<ManifestTable> tables(decodeVarint32(view, offset));
+    for (auto& table : tables) {
+        table.level = decodeVarint32(view, offset);
+        decodeVarint64(view, offset);
+        table.name = decodeView(view, offset, decodeVarint32(view, offset));
+        table.smallest = encodedUserKey(decodeView(view, offset, decodeVarint32(view, offset)));
+        table.largest = encodedUserKey(decodeView(view, offset, decodeVarint32(view, offset)));
+        table.size = decodeVarint64(view, offset);
+    }
+    return tables;
+}
+
+// Whether every level from L1 down is sorted with disjoint key ranges.
+bool levelsDisjoint(const std::vector<ManifestTable>& tables) {
+    for (uint32_t level = 1; level < NUM_LEVELS; level++) {
+        const ManifestTable* previous = nullptr;
+        for (const auto& table : tables) {
+            if (table.level != level) continue;
+            if (table.smallest > table.largest || (previous && previous->largest >= table.smallest)) return false;
+            previous = &table;
+        }
+    }
+    return true;
+}
+
+// Whether a full scan and a get() of every key in model match it exactly.
+bool matchesModel(KVStore& db, const Model& model) {
+    Model scanned;
+    auto it = db.newIterator();
+    for (it->seekToFirst(); it->valid(); it->next()) scanned[std::string(it->key())] = std::string(it->value());
+    if (!it->ok() || scanned != model) return false;
+    for (const auto& [key, value] : model) {
+        if (db.get(key) != value) return false;
+    }
+    return true;
+}
+
+// Small files and levels, so a few hundred KiB spread over several levels.
+Options smallLevels() {
+    Options options;
+    options.compression = CompressionType::None;
+    options.memtableSize = 32 * 1024;
+    options.blockSize = 1024;
+    options.level0CompactionTrigger = 2;
+    options.level1MaxBytes = 64 * 1024;
+    options.levelSizeMultiplier = 4;
+    options.maxFileSize = 32 * 1024;
+    return options;
+}
+
+void testCompactionLevels() {
+    std::cout << "--- [TEST] Leveled compaction ---\n";
+    inScratchDir("test_compaction_levels", []() {
+        Model model;
+        std::mt19937 random(1);
+        std::vector<ManifestTable> before;
+        {
+            KVStore db(smallLevels());
+            for (int i = 0; i < 6000; i++) {
+                std::string key = "key" + std::to_string(10000 + random() % 3000);
+                std::string value = std::to_string(i) + std::string(150, 'v');
+                db.put(key, value);
+                model[key] = value;
+            }
+            db.flush();
+            check("background compaction settles", db.waitForCompactions());
+            check("data reaches L2 and below", db.numFilesAtLevel(2) > 0);
+            check("L0 is below its trigger", db.numFilesAtLevel(0) < 2);
+
+            before = readManifest();
+            std::vector<uint64_t> levelBytes(NUM_LEVELS);
+            for (const auto& table : before) levelBytes[table.level] += table.size;
+            bool withinTargets = true;
+            for (int level = 1; level < NUM_LEVELS - 1; level++) {
+                withinTargets &= levelBytes[level] < 64 * 1024 * static_cast<uint64_t>(std::pow(4, level - 1));
+            }
+            check("every level is within its size target", withinTargets);
+            check("levels from L1 down hold sorted, disjoint key ranges", levelsDisjoint(before));
+            check("contents match every write", matchesModel(db, model));
+        }
+
+        KVStore db(smallLevels());
+        std::vector<ManifestTable> after = readManifest();
+        bool same = after.size() == before.size();
+        for (size_t i = 0; same && i < after.size(); i++) {
+            same = after[i].level == before[i].level && after[i].name == before[i].name;
+        }
+        check("the MANIFEST lists the same tables after reopening", same);
+        check("contents match after reopening", matchesModel(db, model));
+    });
+
+    inScratchDir("test_compaction_overlap", []() {
+        Options options = smallLevels();
+        options.level1MaxBytes = 64 * 1024 * 1024;
+        KVStore db(options);
+        Model model;
+        for (int i = 0; i < 3000; i++) {
+            std::string key = "key" + std::to_string(10000 + i);
+            model[key] = std::string(100, 'v');
+            db.put(key, model[key]);
+        }
+        db.flush();
+        db.compact();
+        std::vector<ManifestTable> before = readManifest();
+
+        // Two L0 files over a narrow range trigger an L0 -> L1 compaction.
+        for (std::string key : {"key11500", "key11501"}) {
+            db.put(key, "new");
+            model[key] = "new";
+            db.flush();
+        }
+        db.waitForCompactions();
+        std::vector<ManifestTable> after = readManifest();
+
+        auto listed = [](const std::vector<ManifestTable>& tables, const ManifestTable& table) {
+            for (const auto& other : tables) {
+                if (other.name == table.name) return true;
+            }
+            return false;
+        };
+        std::string narrow(encodedUserKey(internalKey("key11500", 0, ValueType::Value)));
+        int rewritten = 0, untouchedKept = 0, untouched = 0;
+        for (const auto& table : before) {
+            bool overlaps = table.smallest <= narrow && narrow <= table.largest;
+            if (overlaps) {
+                rewritten += !listed(after, table);
+            } else {
+                untouched++;
+                untouchedKept += listed(after, table);
+            }
+        }
+        check("L1 starts out as several files", before.size() > 4);
+        check("only the overlapping L1 file is rewritten", rewritten == 1 && untouchedKept == untouched);
+        check("L1 stays disjoint", levelsDisjoint(after));
+        check("contents match every write", matchesModel(db, model));
+    });
+}
+
+void testCompactionTombstones() {
+    std::cout << "--- [TEST] Compaction keeps the newest version and drops tombstones only at the bottom ---\n";
+    inScratchDir("test_compaction_tombstones", []() {
+        Model model;
+        std::mt19937 random(2);
+        auto deleteRange = [&](KVStore& db, int from, int to) {
+            for (int i = from; i < to; i++) {
+                db.del("key" + std::to_string(i));
+                model.erase("key" + std::to_string(i));
+            }
+            db.flush();
+        };
+        auto bottomLevel = [](KVStore& db) {
+            int bottom = -1;
+            for (int level = 0; level < NUM_LEVELS; level++) {
+                if (db.numFilesAtLevel(level) > 0) bottom = level;
+            }
+            return bottom;
+        };
+
+        {
+            KVStore db(smallLevels());
+            // Every key rewritten a few times over, so versions meet in every merge.
+            for (int i = 0; i < 8000; i++) {
+                std::string key = "key" + std::to_string(10000 + random() % 2000);
+                std::string value = std::to_string(i) + std::string(100, 'v');
+                db.put(key, value);
+                model[key] = value;
+            }
+            db.flush();
+            db.waitForCompactions();
+            db.compact();
+            int bottom = bottomLevel(db);
+            check("a manual compaction leaves everything at the bottom level, L" + std::to_string(bottom),
+                  bottom >= 2 && db.numFilesAtLevel(0) == 0 && db.numFilesAtLevel(1) == 0);
+            check("the newest version of every key survives", matchesModel(db, model));
+
+            // Two L0 files of deletes go to L1, above the values they delete.
+            deleteRange(db, 10000, 10100);
+            deleteRange(db, 10100, 10200);
+            db.waitForCompactions();
+            check("tombstones above older values are kept", db.numFilesAtLevel(1) > 0);
+            check("the deleted keys stay deleted", matchesModel(db, model));
+        }
+
+        KVStore db(smallLevels());
+        check("and stay deleted after reopening", matchesModel(db, model));
+        deleteRange(db, 10000, 12000);
+        db.compact();
+        int files = 0;
+        for (int level = 0; level < NUM_LEVELS; level++) files += db.numFilesAtLevel(level);
+        check("once everything is deleted and compacted to the bottom no table is left", files == 0);
+        check("and nothing comes back", matchesModel(db, model) && model.empty());
+    });
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void testCompactionScheduler() {
+    std::cout << "--- [TEST] Background compaction keeps up, stalls writes and honors its rate limit ---\n";
+    {
+        // 1 MiB/s with a 100 ms burst: 1.25 MiB from two threads takes over a second.
+        RateLimiter limiter(1024 * 1024);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 2; t++) {
+            threads.emplace_back([&]() {
+                for (int i = 0; i < 10; i++) limiter.request(64 * 1024);
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        double seconds = secondsSince(start);
+        check("the rate limiter paces requests (" + std::to_string(seconds) + " s for 1.25 MiB at 1 MiB/s)",
+              seconds > 1.0 && seconds < 2.5);
+    }
+
+    inScratchDir("test_compaction_scheduler", []() {
+        Options options = smallLevels();
+        options.level0SlowdownTrigger = 3;
+        options.level0StopTrigger = 4;
+        KVStore db(options);
+        std::atomic<bool> done{false};
+        std::atomic<int> maxL0{0};
+        std::thread monitor([&]() {
+            while (!done) {
+                maxL0 = std::max(maxL0.load(), db.numFilesAtLevel(0));
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        Model model;
+        std::mutex modelMutex;
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 2; t++) {
+            writers.emplace_back([&, t]() {
+                for (int i = 0; i < 3000; i++) {
+                    std::string key = "key" + std::to_string(t) + std::to_string(10000 + i);
+                    std::string value(150, 'a' + t);
+                    db.put(key, value);
+                    std::lock_guard<std::mutex> lock(modelMutex);
+                    model[key] = value;
+                }
+            });
+        }
+        for (auto& writer : writers) writer.join();
+        done = true;
+        monitor.join();
+
+        check("writes stall before L0 runs past the stop trigger (max " + std::to_string(maxL0.load()) + ")",
+              maxL0 <= options.level0StopTrigger + 1);
+        db.flush();
+        check("background compaction settles without compact()", db.waitForCompactions());
+        check("L0 ends below its trigger with data further down",
+              db.numFilesAtLevel(0) < options.level0CompactionTrigger && db.numFilesAtLevel(1) + db.numFilesAtLevel(2) > 0);
+        check("contents match every write", matchesModel(db, model));
+    });
+
+    inScratchDir("test_compaction_rate", []() {
+        Options options = smallLevels();
+        options.level0CompactionTrigger = 100;
+        options.level0SlowdownTrigger = 100;
+        options.level0StopTrigger = 100;
+        options.compactionRateLimit = 400 * 1024;
+        KVStore db(options);
+        for (int i = 0; i < 2400; i++) db.put("key" + std::to_string(10000 + i), std::string(150, 'v'));
+        db.flush();
+        auto start = std::chrono::steady_clock::now();
+        db.compact();
+        double seconds = secondsSince(start);
+        check("a compaction of ~400 KiB at 400 KiB/s takes most of a second (" + std::to_string(seconds) + " s)",
+              seconds > 0.7);
+    });
+}
+
+void testSubcompactions() {
+    std::cout << "--- [TEST] Subcompactions split one compaction into disjoint ranges ---\n";
+    struct Result {
+        int l1Files = 0;
+        bool disjoint = false;
+        Model latest, atSnapshot;
+    };
+    auto run = [](int maxSubcompactions) {
+        Result result;
+        inScratchDir("test_subcompactions_" + std::to_string(maxSubcompactions), [&]() {
+            Options options = smallLevels();
+            options.level0CompactionTrigger = 100;
+            options.level0SlowdownTrigger = 100;
+            options.level0StopTrigger = 100;
+            options.level1MaxBytes = 64 * 1024 * 1024;
+            options.maxFileSize = 64 * 1024 * 1024;
+            options.maxSubcompactions = maxSubcompactions;
+            KVStore db(options);
+            // Three rounds over the same keys, with a snapshot holding the first.
+            const Snapshot* snapshot = nullptr;
+            for (int round = 0; round < 3; round++) {
+                for (int i = 0; i < 2500; i++) {
+                    db.put("key" + std::to_string(10000 + i), std::to_string(round) + std::string(150, 'v'));
+                }
+                db.flush();
+                if (round == 0) snapshot = db.getSnapshot();
+            }
+            db.compact();
+            result.l1Files = db.numFilesAtLevel(1);
+            result.disjoint = levelsDisjoint(readManifest());
+
+            ReadOptions readOptions;
+            for (Model* model : {&result.latest, &result.atSnapshot}) {
+                readOptions.snapshot = model == &result.atSnapshot ? snapshot : nullptr;
+                auto it = db.newIterator(readOptions);
+                for (it->seekToFirst(); it->valid(); it->next()) (*model)[std::string(it->key())] = std::string(it->value());
+            }
+            db.releaseSnapshot(snapshot);
+        });
+        return result;
+    };
+
+    Result split = run(4), whole = run(1);
+    check("maxSubcompactions 4 writes one file per range (" + std::to_string(split.l1Files) + ")", split.l1Files == 4);
+    check("maxSubcompactions 1 writes a single file (" + std::to_string(whole.l1Files) + ")", whole.l1Files == 1);
+    check("the ranges' files are disjoint in the MANIFEST", split.disjoint && whole.disjoint);
+    auto allFrom = [](const Model& model, char round) {
+        return model.size() == 2500 &&
+               std::all_of(model.begin(), model.end(), [&](const auto& entry) { return entry.second[0] == round; });
+    };
+    check("both hold the same latest contents", split.latest == whole.latest && allFrom(split.latest, '2'));
+    check("both keep the versions a snapshot sees", split.atSnapshot == whole.atSnapshot && allFrom(split.atSnapshot, '0'));
+}
+
+// --- Upgrades ---
+
+const std::string LEGACY_TOMBSTONE = "~~DELETED~";
+
+// Writes a table the way the first release did: [KeyLen][Key][ValLen][Val] records with
+// big-endian 4-byte lengths, a sparse index of every third record as [KeyLen][Key]
+// [Offset], a bloom filter as [numHashes][sizeInBits][bits, LSB first], and an 8-byte
+// [indexOffset][bloomOffset] footer.
+void writeLegacyTable(const std::string& name, const Model& records) {
+    double bits = -(records.size() * log(0.01)) / (log(2) * log(2));
+    uint32_t sizeInBits = static_cast<uint32_t>(ceil(bits));
+    uint32_t numHashes = static_cast<uint32_t>(ceil(bits / records.size() * log(2)));
+    std::vector<bool> bloom(sizeInBits);
+
+    Buffer data, index;
+    size_t count = 0;
+    for (const auto& [key, value] : records) {
+        size_t h1 = std::hash<std::string>()(key), h2 = std::hash<std::string>()(key + "_salt");
+        for (uint32_t i = 0; i < numHashes; i++) bloom[(h1 + i * h2) % sizeInBits] = true;
+        if (count++ % 3 == 0) {
+            encodeLength(index, key.size());
+            encodeBytes(index, key);
+            encodeLength(index, data.size());
+        }
+        encodeLength(data, key.size());
+        encodeBytes(data, key);
+        encodeLength(data, value.size());
+        encodeBytes(data, value);
+    }
+
+    uint32_t indexOffset = data.size();
+    data.insert(data.end(), index.begin(), index.end());
+    uint32_t bloomOffset = data.size();
+    encodeLength(data, numHashes);
+    encodeLength(data, sizeInBits);
+    for (uint32_t i = 0; i < sizeInBits; i += 8) {
+        uint8_t byte = 0;
+        for (uint32_t bit = 0; bit < 8 && i + bit < sizeInBits; bit++) byte |= bloom[i + bit] << bit;
+        data.push_back(byte);
+    }
+    encodeLength(data, indexOffset);
+    encodeLength(data, bloomOffset);
+
+    std::ofstream out(name, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// Writes a first-release wal.log: a bare run of [KeyLen][Key][ValLen][Val] records.
+void writeLegacyLog(const std::vector<std::pair<std::string, std::string>>& records) {
+    Buffer data;
+    for (const auto& [key, value] : records) {
+        encodeLength(data, key.size());
+        encodeBytes(data, key);
+        encodeLength(data, value.size());
+        encodeBytes(data, value);
+    }
+    std::ofstream out("wal.log", std::ios::binary);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+void testLegacyUpgrade() {
+    std::cout << "--- [TEST] A store written in the first release's format opens and compacts ---\n";
+    inScratchDir("test_legacy_upgrade", []() {
+        // Two tables, oldest first in the text MANIFEST: the newer one overwrites and
+        // deletes keys of the older one, and wal.log overrides both.
+        Model older, newer, expected;
+        for (int i = 0; i < 300; i++) older["k" + std::to_string(1000 + i)] = "old" + std::to_string(i);
+        for (int i = 0; i < 100; i++) newer["k" + std::to_string(1000 + i)] = "new" + std::to_string(i);
+        for (int i = 100; i < 120; i++) newer["k" + std::to_string(1000 + i)] = LEGACY_TOMBSTONE;
+        for (int i = 300; i < 320; i++) newer["k" + std::to_string(1000 + i)] = "new" + std::to_string(i);
+        std::vector<std::pair<std::string, std::string>> log = {
+            {"k1000", "wal0"}, {"k1050", LEGACY_TOMBSTONE}, {"k1110", "revived"}, {"k1319", LEGACY_TOMBSTONE},
+            {"k1000", "wal1"}, {"k1320", "walonly"}};
+
+        for (const auto* table : {&older, &newer}) {
+            for (const auto& [key, value] : *table) expected[key] = value;
+        }
+        for (const auto& [key, value] : log) expected[key] = value;
+        for (auto it = expected.begin(); it != expected.end();) {
+            it = it->second == LEGACY_TOMBSTONE ? expected.erase(it) : std::next(it);
+        }
+
+        writeLegacyTable("L0_001.sst", older);
+        writeLegacyTable("L0_002.sst", newer);
+        writeLegacyLog(log);
+        {
+            std::ofstream manifest("MANIFEST");
+            manifest << "L0_001.sst\nL0_002.sst\n";
+        }
+
+        std::mt19937 random(6);
+        auto matches = [&](KVStore& db) {
+            bool all = true;
+            for (int i = 0; i < 330; i++) {
+                std::string key = "k" + std::to_string(1000 + i);
+                auto pos = expected.find(key);
+                all &= db.get(key) == (pos == expected.end() ? "" : pos->second);
+            }
+            auto it = db.newIterator();
+            return all && compareIterator(*it, expected, "", "", random).empty();
+        };
+
+        {
+            KVStore db;
+            check("every key reads as the newest write after the open", matches(db));
+            auto tables = readManifest();
+            check("the MANIFEST is rewritten in the binary format: both tables, then wal.log's, in L0",
+                  tables.size() == 3 && std::all_of(tables.begin(), tables.end(),
+                                                    [](const ManifestTable& table) { return table.level == 0; }));
+            bool upgraded = !tables.empty();
+            for (const auto& table : tables) upgraded &= tableFooter(table.name).version == SSTABLE_FORMAT_V2;
+            check("the tables are rewritten as v2 and the originals removed",
+                  upgraded && !std::filesystem::exists("L0_001.sst") && !std::filesystem::exists("L0_002.sst"));
+            check("wal.log is replayed and removed", !std::filesystem::exists("wal.log"));
+
+            db.compact();
+            db.waitForCompactions();
+            check("every key still reads the same after compact()", matches(db));
+            check("compact() leaves L0 empty", db.numFilesAtLevel(0) == 0);
+        }
+        KVStore db;
+        check("every key still reads the same after a reopen", matches(db));
+    });
+}
+
+// --- Caches ---
+
+// How many .sst files this process has open right now.
+int openTables() {
+    int open = 0;
+    for (const auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        std::error_code ec;
+        auto target = std::filesystem::read_symlink(entry.path(), ec);
+        open += !ec && target.extension() == ".sst";
+    }
+    return open;
+}
+
+// Options that keep every flush as its own L0 table.
+Options manyTables() {
+    Options options;
+    options.compression = CompressionType::None;
+    options.level0CompactionTrigger = 100;
+    options.level0SlowdownTrigger = 100;
+    options.level0StopTrigger = 100;
+    return options;
+}
+
+void testTableCache() {
+    std::cout << "--- [TEST] The table cache keeps at most maxOpenFiles tables open ---\n";
+    inScratchDir("test_table_cache", []() {
+        Options options = manyTables();
+        options.maxOpenFiles = 2;
+        KVStore db(options);
+        Model model;
+        for (int table = 0; table < 12; table++) {
+            for (int i = 0; i < 200; i++) {
+                std::string key = "key" + std::to_string(10000 + i * 12 + table);
+                model[key] = "table" + std::to_string(table);
+                db.put(key, model[key]);
+            }
+            db.flush();
+        }
+        check("the store holds 12 tables", db.numFilesAtLevel(0) == 12);
+
+        // Readers on every table at once, so tables are evicted and reopened under them.
+        std::atomic<bool> allFound{true};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.emplace_back([&, t]() {
+                std::mt19937 random(t);
+                for (int i = 0; i < 5000; i++) {
+                    auto entry = std::next(model.begin(), random() % model.size());
+                    if (db.get(entry->first) != entry->second) allFound = false;
+                }
+            });
+        }
+        for (auto& reader : readers) reader.join();
+        check("concurrent gets across 12 tables all find their values", allFound);
+        check("contents match every write", matchesModel(db, model));
+        check("no more than 2 tables are left open (" + std::to_string(openTables()) + ")", openTables() <= 2);
+    });
+}
+
+void testBlockCache() {
+    std::cout << "--- [TEST] The block cache evicts by charge in LRU order and keys blocks by table ---\n";
+    {
+        // One shard with room for two 1000-byte blocks but not three.
+        auto block = [](char fill) { return std::make_shared<const Buffer>(1000, fill); };
+        BlockCache cache(2 * (1000 + 200) + 100, 1);
+        cache.insert(1, 0, block('a'));
+        cache.insert(1, 4096, block('b'));
+        cache.insert(2, 0, block('c'));
+        check("a third block evicts the least recently used one",
+              !cache.lookup(1, 0) && cache.lookup(1, 4096) && cache.evictions() == 1);
+        cache.insert(3, 0, block('d'));
+        BlockCache::Handle kept = cache.lookup(1, 4096);
+        check("a lookup keeps a block from being the next to go",
+              kept && (*kept)[0] == 'b' && !cache.lookup(2, 0) && cache.evictions() == 2);
+        BlockCache::Handle other = cache.lookup(3, 0);
+        check("the same offset in another table is another entry", other && (*other)[0] == 'd');
+        check("hits and misses are counted (" + std::to_string(cache.hits()) + " / " +
+                  std::to_string(cache.misses()) + ")",
+              cache.hits() == 3 && cache.misses() == 2);
+        check("usage stays within capacity", cache.usage() <= 2 * (1000 + 200) + 100);
+        cache.insert(4, 0, std::make_shared<const Buffer>(5000, 'e'));
+        check("a block bigger than the cache is not kept", !cache.lookup(4, 0) && cache.lookup(1, 4096));
+    }
+
+    // Two stores in turn with one cache, writing the same file names and block offsets.
+    auto shared = std::make_shared<BlockCache>(32 * 1024, 1);
+    for (int store = 0; store < 2; store++) {
+        inScratchDir("test_block_cache_" + std::to_string(store), [&]() {
+            Options options;
+            options.compression = CompressionType::None;
+            options.blockCache = shared;
+            KVStore db(options);
+            Model model;
+            for (int i = 0; i < 10000; i++) {
+                std::string key = "key" + std::to_string(10000 + i);
+                model[key] = "store" + std::to_string(store) + std::string(80, 'v');
+                db.put(key, model[key]);
+            }
+            db.flush();
+            std::string name = "store " + std::to_string(store) + ": ";
+            check(name + "the store uses the cache it was given", db.getBlockCache() == shared);
+
+            uint64_t evictions = shared->evictions();
+            std::mt19937 random(store);
+            bool allFound = true;
+            for (int i = 0; i < 3000; i++) {
+                auto entry = std::next(model.begin(), random() % model.size());
+                allFound &= db.get(entry->first) == entry->second;
+            }
+            check(name + "gets through a cache a fraction of the table's size all find their values", allFound);
+            check(name + "the cache evicts to stay within its capacity",
+                  shared->evictions() > evictions && shared->usage() <= 32 * 1024);
+
+            db.get("key10000");
+            uint64_t hits = shared->hits(), misses = shared->misses();
+            check(name + "a repeated get is served from the cache",
+                  db.get("key10000") == model["key10000"] && shared->misses() == misses && shared->hits() > hits);
+        });
+    }
+}
+
+// Blocks read through the store's block cache so far, hits and misses alike.
+uint64_t blockReads(KVStore& db) {
+    return db.getBlockCache()->hits() + db.getBlockCache()->misses();
+}
+
+// Full scan of what readOptions allows; returns how many entries it saw.
+int scanCount(KVStore& db, const ReadOptions& readOptions) {
+    int entries = 0;
+    auto it = db.newIterator(readOptions);
+    for (it->seekToFirst(); it->valid(); it->next()) entries++;
+    return entries;
+}
+
+void testTableSkipping() {
+    std::cout << "--- [TEST] Lookups and scans skip tables by key range and prefix filter ---\n";
+    struct Reads {
+        uint64_t get = 0, gap = 0, bounded = 0, prefixed = 0;
+        int boundedEntries = 0, prefixedEntries = 0;
+    };
+    // One L0 table per group of key prefixes, 500 keys per prefix. The same reads are
+    // then run against a store holding only the table they need, so every block read
+    // beyond that one's would be a table that should have been skipped.
+    auto run = [](const std::string& dir, const std::vector<std::vector<std::string>>& tables, bool prefixFilter) {
+        Reads reads;
+        inScratchDir(dir, [&]() {
+            Options options = manyTables();
+            options.bloomBitsPerKey = prefixFilter ? 10 : 0;
+            options.prefixBloomLength = prefixFilter ? 6 : 0;
+            KVStore db(options);
+            for (const auto& prefixes : tables) {
+                for (const auto& prefix : prefixes) {
+                    for (int i = 0; i < 500; i++) db.put(prefix + std::to_string(10000 + i), std::string(100, 'v'));
+                }
+                db.flush();
+            }
+
+            uint64_t before = blockReads(db);
+            if (prefixFilter) {
+                ReadOptions readOptions;
+                readOptions.prefix = "user2:";
+                reads.prefixedEntries = scanCount(db, readOptions);
+                reads.prefixed = blockReads(db) - before;
+                return;
+            }
+            db.get("banana:10250");
+            reads.get = blockReads(db) - before;
+            before = blockReads(db);
+            db.get("b");
+            reads.gap = blockReads(db) - before;
+            ReadOptions readOptions;
+            readOptions.lowerBound = "banana:";
+            readOptions.upperBound = "banana;";
+            before = blockReads(db);
+            reads.boundedEntries = scanCount(db, readOptions);
+            reads.bounded = blockReads(db) - before;
+        });
+        return reads;
+    };
+
+    // No key filter, so only the key ranges can keep get() out of the other tables.
+    Reads all = run("test_skip_ranges", {{"apple:"}, {"banana:"}, {"cherry:"}}, false);
+    Reads one = run("test_skip_ranges_one", {{"banana:"}}, false);
+    check("a get reads no more blocks than with only its table (" + std::to_string(all.get) + " vs " +
+              std::to_string(one.get) + ")",
+          all.get > 0 && all.get == one.get);
+    check("a get between the tables' ranges reads no block", all.gap == 0);
+    check("a bounded scan reads no more blocks than with only its table (" + std::to_string(all.bounded) + " vs " +
+              std::to_string(one.bounded) + ")",
+          all.boundedEntries == 500 && all.bounded == one.bounded);
+
+    // Both tables' ranges cover user2:, but only the second table's prefix filter passes it.
+    Reads both = run("test_skip_prefix", {{"user1:", "user3:"}, {"user2:", "user4:"}}, true);
+    Reads second = run("test_skip_prefix_one", {{"user2:", "user4:"}}, true);
+    check("a prefix scan skips a table its prefix filter rules out (" + std::to_string(both.prefixed) + " vs " +
+              std::to_string(second.prefixed) + ")",
+          both.prefixedEntries == 500 && both.prefixed == second.prefixed);
+}
+
+// Bytes of the top-level index of the table file at path, as the footer gives them.
+uint64_t topLevelIndexBytes(const std::string& path) {
+    auto file = RandomAccessFile::open(path, false);
+    SSTableFooter footer;
+    if (!file || !readFooter(*file, footer)) return 0;
+    return footer.bloomOffset - footer.indexOffset;
+}
+
+void testPartitionLoading() {
+    std::cout << "--- [TEST] Index partitions and filters are loaded on demand, one of each per lookup ---\n";
+    uint64_t topLevel[2] = {0, 0};
+    int run = 0;
+    for (size_t partitionSize : {size_t(4096), size_t(512)}) {
+        inScratchDir("test_partitions_" + std::to_string(partitionSize), [&]() {
+            Options options;
+            options.compression = CompressionType::None;
+            options.indexPartitionSize = partitionSize;
+            options.bloomBitsPerKey = 20;
+            options.pinL0Filters = false;
+            {
+                KVStore db(options);
+                for (int i = 0; i < 20000; i++) db.put("key" + std::to_string(100000 + i * 2), std::string(100, 'v'));
+                db.flush();
+            }
+            for (const auto& entry : std::filesystem::directory_iterator(".")) {
+                if (entry.path().extension() == ".sst") topLevel[run] = topLevelIndexBytes(entry.path().string());
+            }
+
+            std::string label = std::to_string(partitionSize) + "-byte partitions: ";
+            KVStore db(options);
+            check(label + "opening the store reads no partition or filter", blockReads(db) == 0);
+
+            // A scan loads every index partition and data block but no filter; after it a
+            // get may only miss on the filter of the one partition it looks in.
+            scanCount(db, ReadOptions());
+            std::mt19937 random(7);
+            bool oneFilter = true;
+            uint64_t filtersLoaded = 0;
+            for (int i = 0; i < 200; i++) {
+                uint64_t misses = db.getBlockCache()->misses();
+                db.get("key" + std::to_string(100000 + static_cast<int>(random() % 20000) * 2));
+                uint64_t loaded = db.getBlockCache()->misses() - misses;
+                oneFilter &= loaded <= 1;
+                filtersLoaded += loaded;
+            }
+            check(label + "a get of a present key loads at most one filter partition besides what the scan cached",
+                  oneFilter && filtersLoaded > 0);
+
+            // Odd keys are never written, so the filter partition alone turns them away,
+            // bar a false positive, which then reads one index partition and data block.
+            int filterOnly = 0;
+            bool oneEach = true;
+            for (int i = 0; i < 200; i++) {
+                uint64_t before = blockReads(db);
+                db.get("key" + std::to_string(100001 + static_cast<int>(random() % 19999) * 2));
+                uint64_t reads = blockReads(db) - before;
+                filterOnly += reads == 1;
+                oneEach &= reads == 1 || reads == 3;
+            }
+            check(label + "a get of an absent key reads its filter partition and nothing else (" +
+                      std::to_string(filterOnly) + " of 200)",
+                  oneEach && filterOnly >= 195);
+        });
+        run++;
+    }
+    check("smaller partitions make a larger top-level index (" + std::to_string(topLevel[0]) + " vs " +
+              std::to_string(topLevel[1]) + " bytes)",
+          topLevel[0] > 0 && topLevel[1] > 4 * topLevel[0]);
+}
+
+// --- Concurrent reads ---
+
+void testConsistentReads(bool mmap) {
+    std::cout << "--- [TEST] Readers see whole batches while flushes and compactions install versions"
+              << readPath(mmap) << " ---\n";
+    inScratchDir("test_consistent_reads", [&]() {
+        const int keys = 50, generations = 200;
+        Options options;
+        options.useMmapReads = mmap;
+        options.memtableSize = 32 * 1024;
+        options.level0CompactionTrigger = 2;
+        KVStore db(options);
+        auto keyFor = [](int i) { return "key" + std::to_string(i); };
+
+        // Every generation rewrites all the keys in one batch, so any consistent view
+        // has them all at the same generation.
+        std::atomic<bool> done{false};
+        std::atomic<int> torn{0}, missing{0}, backwards{0}, scans{0};
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 2; r++) {
+            readers.emplace_back([&, r]() {
+                int lastSeen = 0;
+                for (int n = 0; !done; n++) {
+                    if (n % 2 == r) {
+                        auto it = db.newIterator();
+                        int count = 0;
+                        std::string first;
+                        bool same = true;
+                        for (it->seekToFirst(); it->valid(); it->next(), count++) {
+                            if (count == 0) first = std::string(it->value());
+                            same &= it->value() == first;
+                        }
+                        if (count != 0 && (count != keys || !same || !it->ok())) torn++;
+                        scans++;
+                    } else {
+                        std::string value = db.get(keyFor(n % keys));
+                        if (value.empty()) {
+                            if (lastSeen > 0) missing++;
+                            continue;
+                        }
+                        int generation = std::stoi(value);
+                        if (generation < lastSeen) backwards++;
+                        lastSeen = generation;
+                    }
+                }
+            });
+        }
+
+        for (int g = 1; g <= generations; g++) {
+            WriteBatch batch;
+            for (int i = 0; i < keys; i++) batch.put(keyFor(i), std::to_string(g));
+            db.write(batch);
+            if (g % 10 == 0) db.flush();
+            if (g % 50 == 0) db.compact();
+        }
+        done = true;
+        for (auto& reader : readers) reader.join();
+
+        check("scans ran alongside the writes (" + std::to_string(scans.load()) + ")", scans > 0);
+        check("no scan saw two generations at once", torn == 0);
+        check("no lookup lost a key it had seen", missing == 0);
+        check("no lookup went back a generation", backwards == 0);
+        check("the last generation is what remains", db.get(keyFor(0)) == std::to_string(generations));
+    });
+
+    // An iterator and a pinned value read from a table that a compaction then replaces;
+    // the last of them to go evicts the table from the table cache and unmaps it.
+    inScratchDir("test_consistent_reads_pinned", [&]() {
+        Options options;
+        options.useMmapReads = mmap;
+        options.compression = CompressionType::None;
+        options.maxOpenFiles = 1;
+        KVStore db(options);
+        for (int i = 0; i < 1000; i++) db.put("key" + std::to_string(10000 + i), "old" + std::to_string(i));
+        db.flush();
+
+        PinnableSlice value;
+        db.get("key10500", value);
+        check("a lookup in a table is pinned, not copied", value.isPinned() && value.data() == "old500");
+        auto it = db.newIterator();
+        it->seekToFirst();
+
+        for (int i = 0; i < 1000; i++) db.put("key" + std::to_string(10000 + i), "new" + std::to_string(i));
+        db.flush();
+        db.compact();
+        check("the compaction replaced the table", db.get("key10500") == "new500" && db.numFilesAtLevel(0) == 0);
+
+        int count = 0;
+        bool old = true;
+        for (; it->valid(); it->next(), count++) old &= it->value() == "old" + std::to_string(count);
+        check("an iterator opened before the compaction still reads the old table whole",
+              count == 1000 && old && it->ok());
+        it.reset();
+        check("a value pinned before the compaction outlives the iterator", value.data() == "old500");
+    });
+}
+
+// --- MemTable ---
+
+void testArena() {
+    std::cout << "--- [TEST] Arena hands out disjoint memory and counts what it hands out ---\n";
+    {
+        Arena arena;
+        for (int i = 0; i < 100; i++) arena.allocate(20);
+        check("usage is the bytes allocated, rounded to alignment", arena.memoryUsage() == 100 * 24);
+    }
+    {
+        const int threads = 8, perThread = 20000;
+        Arena arena;
+        std::vector<std::vector<uint64_t*>> slots(threads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                for (int i = 0; i < perThread; i++) {
+                    // Mostly small nodes, with an occasional large one.
+                    size_t bytes = i % 1000 == 0 ? ARENA_BLOCK_SIZE / 2 : 16;
+                    auto* slot = reinterpret_cast<uint64_t*>(arena.allocate(bytes));
+                    slot[0] = static_cast<uint64_t>(t) << 32 | i;
+                    slot[1] = ~slot[0];
+                    slots[t].push_back(slot);
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        bool intact = true;
+        for (int t = 0; t < threads; t++) {
+            for (int i = 0; i < perThread; i++) {
+                uint64_t stamp = static_cast<uint64_t>(t) << 32 | i;
+                intact &= slots[t][i][0] == stamp && slots[t][i][1] == ~stamp;
+            }
+        }
+        check("concurrent allocations never overlap", intact);
+    }
+    {
+        MemTable table;
+        for (int i = 0; i < 100; i++) table.insert(internalKey("key" + std::to_string(i), i + 1, ValueType::Value), "value");
+        check("a memtable of 100 small entries counts well under one arena block",
+              table.approximateMemoryUsage() < 16 * 1024);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::pair<std::string, void (*)()>> tests = {
+        {"wal-open", testWalOpenFailure},
+        {"flush-failure", testFlushFailure},
+        {"batch-replay", testBatchReplay},
+        {"wal-corruption", testWalCorruption},
+        {"recovery-fallback", testRecoveryFallback},
+        {"nul-keys", testNulKeys},
+        {"snapshots", testSnapshots},
+        {"bloom-filter", testBloomFilter},
+        {"iterator-model", []() { testIteratorModel(false); }},
+        {"iterator-model-mmap", []() { testIteratorModel(true); }},
+        {"lz-round-trip", testLzRoundTrip},
+        {"checksums", []() { testChecksums(false); }},
+        {"checksums-mmap", []() { testChecksums(true); }},
+        {"sstable-footer", testSSTableFooter},
+        {"compaction-levels", testCompactionLevels},
+        {"compaction-tombstones", testCompactionTombstones},
+        {"compaction-scheduler", testCompactionScheduler},
+        {"subcompactions", testSubcompactions},
+        {"legacy-upgrade", testLegacyUpgrade},
+        {"table-cache", testTableCache},
+        {"block-cache", testBlockCache},
+        {"table-skipping", testTableSkipping},
+        {"partition-loading", testPartitionLoading},
+        {"arena", testArena},
+        {"consistent-reads", []() { testConsistentReads(false); }},
+        {"consistent-reads-mmap", []() { testConsistentReads(true); }},
+    };
+
+    std::string only = argc > 1 ? argv[1] : "";
+    bool ran = false;
+    for (const auto& [name, fn] : tests) {
+        if (!only.empty() && only != name) continue;
+        fn();
+        ran = true;
+    }
+    if (!ran) {
+        std::cerr << "Unknown test. Use one of:";
+        for (const auto& test : tests) std::cerr << " " << test.first;
+        std::cerr << "\n";
+        return 1;
+    }
+
+    if (failures == 0) {
+        std::cout << "\n✅ SUCCESS: all checks passed\n";
+        return 0;
+    }
+    std::cout << "\n❌ FAILURE: " << failures << " check(s) failed\n";
+    return 1;
+}